@@ -8,11 +8,12 @@
 
 #include "BTreeVectorImpl_priv.h"
 
-template<typename T, int MAX_NODE_BLOCK_SIZE = 16, int MAX_LEAF_BLOCK_SIZE = 128>
+template<typename T, int MAX_NODE_BLOCK_SIZE = 16, int MAX_LEAF_BLOCK_SIZE = 128, BTreeLeafLayout LEAF_LAYOUT = BTreeLeafLayout::Plain,
+        int INLINE_CAPACITY = 0>
 class BTreeVector
 {
 private:
-    BTreeVectorImpl<T, MAX_NODE_BLOCK_SIZE, MAX_LEAF_BLOCK_SIZE> impl;
+    BTreeVectorImpl<T, MAX_NODE_BLOCK_SIZE, MAX_LEAF_BLOCK_SIZE, LEAF_LAYOUT, INLINE_CAPACITY> impl;
 public:
 
     inline void clear()
@@ -25,21 +26,139 @@ public:
         return impl.size();
     }
 
+    inline int freeze()
+    {
+        return impl.freeze();
+    }
+
+    inline size_t memoryUsage()
+    {
+        return impl.memoryUsage();
+    }
+
+    inline bool compact(float fillFactor = 1.0f, int maxElements = 0)
+    {
+        return impl.compact(fillFactor, maxElements);
+    }
+
+    inline bool shrink_to_fit(int maxElements = 0)
+    {
+        return impl.shrink_to_fit(maxElements);
+    }
+
+    // takes effect with the next remove; blocks left underfull by a relaxed policy are repacked by compact()
+    inline void setRebalance(BTreeRebalance policy)
+    {
+        impl.setRebalance(policy);
+    }
+
+    inline int find(const T & value, int from = 0)
+    {
+        return impl.find(value, from);
+    }
+
+    inline int rfind(const T & value, int from = -1)
+    {
+        return impl.rfind(value, from);
+    }
+
+    inline int count(const T & value)
+    {
+        return impl.count(value);
+    }
+
+    template<typename F>
+    inline int find_if(F pred, int from = 0)
+    {
+        return impl.find_if(pred, from);
+    }
+
+    template<typename Compare = std::less<T>>
+    inline void sort(Compare comp = Compare())
+    {
+        impl.sort(comp);
+    }
+
+    template<typename Compare = std::less<T>>
+    inline void stable_sort(Compare comp = Compare())
+    {
+        impl.stable_sort(comp);
+    }
+
     inline T get(int pos)
     {
         return impl.get(pos);
     }
 
+    // no range check, asserted unless NDEBUG is defined
     inline T & operator[](int pos)
     {
         return impl[pos];
     }
 
+    // throws std::out_of_range
+    inline T & at(int pos)
+    {
+        return impl.at(pos);
+    }
+
     inline T set(int pos, T element)
     {
         return impl.set(pos, element);
     }
 
+    typedef int Handle;
+
+    // follows the element at pos through inserts and removes until released
+    inline Handle handle(int pos)
+    {
+        return impl.handle(pos);
+    }
+
+    // O(log n), -1 if the element was removed or the handle is not held
+    inline int position_of(Handle h)
+    {
+        return impl.position_of(h);
+    }
+
+    // no-op for a handle that is not held, e.g. one already released
+    inline void release(Handle h)
+    {
+        impl.release(h);
+    }
+
+    template<int I>
+    inline typename std::tuple_element<I, T>::type getField(int pos)
+    {
+        return impl.template getField<I>(pos);
+    }
+
+    template<int I, typename F>
+    inline void forEachColumn(F f)
+    {
+        impl.template forEachColumn<I>(f);
+    }
+
+    // frozen columns stay packed
+    template<int I, typename F>
+    inline void forEachConstColumn(F f)
+    {
+        impl.template forEachConstColumn<I>(f);
+    }
+
+    template<typename F>
+    inline void forEachSpan(F f)
+    {
+        impl.forEachSpan(f);
+    }
+
+    // frozen leaves stay packed
+    template<typename F>
+    inline void forEachConstSpan(F f)
+    {
+        impl.forEachConstSpan(f);
+    }
+
     inline void add(T element)
     {
         impl.add(element);
@@ -55,6 +174,38 @@ public:
         impl.remove(pos);
     }
 
+    // deque operations, amortized O(1) at either end; front() and back() throw std::out_of_range when empty
+
+    inline void push_back(T element)
+    {
+        impl.push_back(element);
+    }
+
+    inline void push_front(T element)
+    {
+        impl.push_front(element);
+    }
+
+    inline void pop_back()
+    {
+        impl.pop_back();
+    }
+
+    inline void pop_front()
+    {
+        impl.pop_front();
+    }
+
+    inline T front()
+    {
+        return impl.front();
+    }
+
+    inline T back()
+    {
+        return impl.back();
+    }
+
 };
 
 #endif /* SRC_BTREEVECTOR_H_ */
@@ -7,45 +7,231 @@
 #ifndef BTREEVECTORIMPL_H_
 #define BTREEVECTORIMPL_H_
 
-#include <iostream>
 #include <cstring>
+#include <stdexcept>
+#include <string>
 #include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <climits>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <assert.h>
+#include "BTreeVectorScan_priv.h"
+
+enum class BTreeLeafLayout
+{
+    Plain, // elements kept contiguous, inserts shift the tail of the leaf
+    GapBuffer, // free space kept at the last edit point, adjacent edits are O(1)
+    Columnar // tuple-like elements (std::tuple, std::pair, std::array) stored as one array per field, no references to whole elements
+};
+
+// when a block is merged with or refilled from a sibling after a delete
+enum class BTreeRebalance
+{
+    Eager, // below half full
+    Relaxed, // below a quarter full, then the pair is evened out so it does not thrash at the boundary
+    Deferred // only empty leaves and single-child nodes, compact() restores the fill later
+};
+
+// Out of line and cold, so the range checks on the lookup path stay small enough to inline
+[[noreturn]] __attribute__((noinline, cold)) inline void btreeVectorOutOfRange(int pos, int size)
+{
+    throw std::out_of_range("BTreeVector index " + std::to_string(pos) + " out of range 0:" + std::to_string(size - 1));
+}
+
+// Optional DataBlock fields: the empty specializations keep blocks that cannot use them at their plain size
+
+// frozen form of an integral block
+template<typename BT, bool PACKABLE>
+struct BTreePackedFields
+{
+    const static bool packable = true;
+    uint8_t * packed = nullptr;
+    typename std::make_unsigned<BT>::type packedBase = 0;
+    int packedBits = 0;
+};
+
+template<typename BT>
+struct BTreePackedFields<BT, false>
+{
+    const static bool packable = false;
+    constexpr static uint8_t * packed = nullptr;
+    constexpr static uint64_t packedBase = 0;
+    constexpr static int packedBits = 0;
+};
+
+// GAP: elements [0, gapStart) are at buf[0..], the rest follow the bufSize - count free slots
+template<bool GAP>
+struct BTreeGapFields
+{
+    int gapStart = 0;
+};
+
+template<>
+struct BTreeGapFields<false>
+{
+    constexpr static int gapStart = 0;
+};
+
+// types with std::tuple_size, the element types of the Columnar layout
+template<typename BT, typename = void>
+struct BTreeTupleLike: std::false_type
+{
+};
+
+template<typename BT>
+struct BTreeTupleLike<BT, std::void_t<decltype(std::tuple_size<BT>::value)>> : std::true_type
+{
+};
 
 //forward declaration
-template<typename T, int MAX_NODE_BLOCK_SIZE, int MAX_LEAF_BLOCK_SIZE>
+template<typename T, int MAX_NODE_BLOCK_SIZE, int MAX_LEAF_BLOCK_SIZE, BTreeLeafLayout LEAF_LAYOUT, int INLINE_CAPACITY>
 class BTreeVector;
+template<typename T, int MAX_NODE_BLOCK_SIZE, int MAX_LEAF_BLOCK_SIZE, BTreeLeafLayout LEAF_LAYOUT>
+class ConcurrentBTreeVector;
 
-template<typename T, int MAX_NODE_BLOCK_SIZE = 16, int MAX_LEAF_BLOCK_SIZE = 128>
+// INLINE_CAPACITY > 0: up to that many elements are kept inside the object, the tree is allocated on overflow
+template<typename T, int MAX_NODE_BLOCK_SIZE = 16, int MAX_LEAF_BLOCK_SIZE = 128, BTreeLeafLayout LEAF_LAYOUT = BTreeLeafLayout::Plain,
+        int INLINE_CAPACITY = 0>
 class BTreeVectorImpl
 {
-    friend class BTreeVector<T, MAX_NODE_BLOCK_SIZE, MAX_LEAF_BLOCK_SIZE> ;
+    friend class BTreeVector<T, MAX_NODE_BLOCK_SIZE, MAX_LEAF_BLOCK_SIZE, LEAF_LAYOUT, INLINE_CAPACITY> ;
+    friend class ConcurrentBTreeVector<T, MAX_NODE_BLOCK_SIZE, MAX_LEAF_BLOCK_SIZE, LEAF_LAYOUT> ;
 
     static_assert((MAX_NODE_BLOCK_SIZE % 2) == 0 && MAX_NODE_BLOCK_SIZE >= 4,"Template parameter MAX_NODE_BLOCK_SIZE must be even and not less than 4");
     static_assert((MAX_LEAF_BLOCK_SIZE % 2) == 0 && MAX_LEAF_BLOCK_SIZE >= 4,"Template parameter MAX_LEAF_BLOCK_SIZE must be even and not less than 4");
+    static_assert(INLINE_CAPACITY >= 0 && INLINE_CAPACITY <= MAX_LEAF_BLOCK_SIZE,"Template parameter INLINE_CAPACITY must be within 0:MAX_LEAF_BLOCK_SIZE");
+    static_assert(LEAF_LAYOUT != BTreeLeafLayout::Columnar || BTreeTupleLike<T>::value,
+            "The Columnar layout needs a tuple-like T: std::tuple, std::pair, std::array or a type with std::tuple_size, std::tuple_element and get<I>()");
 
     struct Node;
     struct Path;
 
+    // elements of a small vector, constructed in place
+    template<typename BT, int N>
+    struct InlineBlock
+    {
+        alignas(BT) unsigned char storage[N * sizeof(BT)];
+        int count = 0;
+
+        inline BT * items()
+        {
+            return reinterpret_cast<BT *>(storage);
+        }
+
+        void add(int idx, BT element)
+        {
+            BT * p = items();
+            if (idx == count)
+                new (p + count) BT(std::move(element));
+            else
+            {
+                new (p + count) BT(std::move(p[count - 1]));
+                std::move_backward(p + idx, p + count - 1, p + count);
+                p[idx] = std::move(element);
+            }
+            count++;
+        }
+
+        void remove(int idx)
+        {
+            BT * p = items();
+            std::move(p + idx + 1, p + count, p + idx);
+            p[--count].~BT();
+        }
+
+        void clear()
+        {
+            BT * p = items();
+            for (int i = 0; i < count; i++)
+                p[i].~BT();
+            count = 0;
+        }
+    };
+
+    template<typename BT>
+    struct InlineBlock<BT, 0>
+    {
+        static const int count = 0;
+
+        inline BT * items()
+        {
+            return nullptr;
+        }
+
+        void add(int, BT)
+        {
+        }
+
+        void remove(int)
+        {
+        }
+
+        void clear()
+        {
+        }
+    };
+
     Node * root;
     int structModCount = 0;
+    BTreeRebalance rebalance = BTreeRebalance::Eager;
     Path cachePath = Path(this);
-
-    template<typename BT, bool BT_IS_TRIVIAL, int INCREASE_PRC, int MAX_SIZE>
-    struct DataBlock
+    int compactPos = 0;
+    int shrinkPos = 0;
+    // elements live here while root is null
+    [[no_unique_address]] InlineBlock<T, INLINE_CAPACITY> small;
+
+    // Handle table: a handle follows its element through inserts, removes and rebalancing.
+    // leaf == nullptr once the element is removed, idx == -1 once the handle is released.
+    struct Anchor
+    {
+        Node * leaf;
+        int idx;
+    };
+    struct HandleTable
+    {
+        std::vector<Anchor> anchors;
+        std::vector<int> freeAnchors;
+        // ids of the handles into each leaf, no entry for a leaf without handles
+        std::unordered_map<Node *, std::vector<int>> leafAnchors;
+        int live = 0;
+    };
+    // allocated by the first handle()
+    HandleTable * handles = nullptr;
+    struct EdgePath;
+    // first and last leaf paths of the deque operations, allocated on first use
+    EdgePath * edges = nullptr;
+
+    // integral leaves can be frozen into a frame-of-reference, bit-packed form
+    template<typename BT, bool BT_IS_TRIVIAL, int INCREASE_PRC, int MAX_SIZE, bool GAP = false,
+            typename PACKED = BTreePackedFields<BT, BT_IS_TRIVIAL && std::is_integral<BT>::value && !std::is_same<BT, bool>::value>>
+    struct DataBlock: private PACKED, private BTreeGapFields<GAP>
     {
     private:
-        typedef DataBlock<BT, BT_IS_TRIVIAL, INCREASE_PRC, MAX_SIZE> ThisDataBlock;
+        typedef DataBlock<BT, BT_IS_TRIVIAL, INCREASE_PRC, MAX_SIZE, GAP, PACKED> ThisDataBlock;
+        using PACKED::packable;
+        using PACKED::packed;
+        using PACKED::packedBase;
+        using PACKED::packedBits;
+        using BTreeGapFields<GAP>::gapStart;
         BT * buf, *orgBuf;
         int bufSize = MAX_SIZE >> 1;
         int count = 0;
         const static bool moveopt = true;
+        // elements decoded at a time by the packed searches, a multiple of 8
+        constexpr static int PACKED_CHUNK = 64;
 
     public:
 
         DataBlock()
         {
-            if (BT_IS_TRIVIAL)
+            if constexpr (BT_IS_TRIVIAL)
                 orgBuf = buf = (BT*) malloc(bufSize * sizeof(BT));
             else
                 orgBuf = buf = new BT[bufSize];
@@ -53,20 +239,25 @@ class BTreeVectorImpl
 
         ~DataBlock()
         {
-            if (BT_IS_TRIVIAL)
+            if constexpr (BT_IS_TRIVIAL)
                 free(orgBuf);
             else
                 delete[] orgBuf;
+            free(packed);
         }
 
         inline BT get(int idx)
         {
-            return buf[idx];
+            if constexpr (packable)
+                if (packed != nullptr)
+                    return unpackAt(idx);
+            return buf[phys(idx)];
         }
 
         inline BT & getRef(int idx)
         {
-            return buf[idx];
+            thaw();
+            return buf[phys(idx)];
         }
 
         inline int size()
@@ -76,16 +267,29 @@ class BTreeVectorImpl
 
         void add(BT element)
         {
+            thaw();
+            if (GAP)
+                moveGap(count);
             ensure(count + 1);
             buf[count++] = std::move(element);
+            if constexpr (GAP)
+                gapStart++;
         }
 
         void add(int idx, BT element)
         {
+            thaw();
             if (moveopt && idx == 0 && buf != orgBuf)
             {
                 buf--;
                 bufSize++;
+                if constexpr (GAP)
+                    gapStart++;
+            } else if constexpr (GAP)
+            {
+                ensure(count + 1);
+                moveGap(idx);
+                gapStart++;
             } else
             {
                 expand(idx, 1);
@@ -94,18 +298,48 @@ class BTreeVectorImpl
             buf[idx] = std::move(element);
         }
 
+        // push_front: the elements move to the end of the buffer once, the next prepends take the slots freed before them
+        void addFront(BT element)
+        {
+            if constexpr (!GAP)
+            {
+                thaw();
+                if (buf == orgBuf && count > 0)
+                {
+                    ensure(count + 1);
+                    int room = bufSize - count;
+                    xmemmove(buf + room, buf, count, true);
+                    buf += room;
+                    bufSize = count;
+                }
+            }
+            add(0, std::move(element));
+        }
+
         void set(int idx, BT element)
         {
-            buf[idx] = std::move(element);
+            thaw();
+            buf[phys(idx)] = std::move(element);
+        }
+
+        BT exchange(int idx, BT element)
+        {
+            thaw();
+            BT old = std::move(buf[phys(idx)]);
+            buf[phys(idx)] = std::move(element);
+            return old;
         }
 
         void remove(int idx)
         {
-            if (moveopt && idx == 0)
+            thaw();
+            if (moveopt && idx == 0 && (!GAP || gapStart > 0))
             {
                 buf++;
                 bufSize--;
                 count--;
+                if constexpr (GAP)
+                    gapStart--;
             } else
             {
                 removeRange(idx, 1);
@@ -115,24 +349,321 @@ class BTreeVectorImpl
         void insertRange(ThisDataBlock * dst, int from, int to, int cnt)
         {
             assert(dst != this);
+            thaw();
+            dst->thaw();
+            closeGap();
             dst->expand(to, cnt);
             xmemmove(&dst->buf[to], &buf[from], cnt);
             dst->count += cnt;
+            if constexpr (GAP)
+                dst->gapStart += cnt;
         }
 
         void removeRange(int start, int cnt)
         {
+            thaw();
+            if (GAP)
+            {
+                // the gap swallows the removed elements
+                moveGap(start);
+                count -= cnt;
+                return;
+            }
             int end = start + cnt;
             if (end < count)
                 xmemmove(&buf[start], &buf[end], (count - end));
             count -= cnt;
         }
 
+        // Searches: [from, to) ranges split at the gap, packed blocks decoded chunk by chunk
+
+        int indexOf(const BT & value, int from)
+        {
+            if constexpr (packable)
+                if (packed != nullptr)
+                {
+                    uint64_t delta;
+                    if (!packedDelta(value, delta))
+                        return -1;
+                    BT chunk[PACKED_CHUNK];
+                    for (int first = from / PACKED_CHUNK * PACKED_CHUNK; first < count; first += PACKED_CHUNK)
+                    {
+                        int n = unpackChunk(chunk, first);
+                        int idx = BTreeVectorScan::findFirst(chunk, std::max(0, from - first), n, value);
+                        if (idx >= 0)
+                            return first + idx;
+                    }
+                    return -1;
+                }
+            int split = GAP ? std::max(from, gapStart) : count;
+            int idx = BTreeVectorScan::findFirst(buf, from, split, value);
+            if (idx < 0 && split < count)
+                idx = BTreeVectorScan::findFirst(buf + bufSize - count, split, count, value);
+            return idx;
+        }
+
+        // searches [0, to)
+        int lastIndexOf(const BT & value, int to)
+        {
+            if constexpr (packable)
+                if (packed != nullptr)
+                {
+                    uint64_t delta;
+                    if (!packedDelta(value, delta))
+                        return -1;
+                    BT chunk[PACKED_CHUNK];
+                    for (int first = (to - 1) / PACKED_CHUNK * PACKED_CHUNK; to > 0 && first >= 0; first -= PACKED_CHUNK)
+                    {
+                        int n = unpackChunk(chunk, first);
+                        int idx = BTreeVectorScan::findLast(chunk, 0, std::min(n, to - first), value);
+                        if (idx >= 0)
+                            return first + idx;
+                    }
+                    return -1;
+                }
+            int split = GAP ? std::min(to, gapStart) : to;
+            int idx = -1;
+            if (split < to)
+                idx = BTreeVectorScan::findLast(buf + bufSize - count, split, to, value);
+            if (idx < 0)
+                idx = BTreeVectorScan::findLast(buf, 0, split, value);
+            return idx;
+        }
+
+        int countOf(const BT & value)
+        {
+            if constexpr (packable)
+                if (packed != nullptr)
+                {
+                    uint64_t delta;
+                    int cnt = 0;
+                    if (!packedDelta(value, delta))
+                        return 0;
+                    BT chunk[PACKED_CHUNK];
+                    for (int first = 0; first < count; first += PACKED_CHUNK)
+                        cnt += BTreeVectorScan::count(chunk, 0, unpackChunk(chunk, first), value);
+                    return cnt;
+                }
+            int split = GAP ? gapStart : count;
+            return BTreeVectorScan::count(buf, 0, split, value) + BTreeVectorScan::count(buf + bufSize - count, split, count, value);
+        }
+
+        template<typename F>
+        int findIf(F & pred, int from)
+        {
+            if (packed != nullptr)
+            {
+                for (int i = from; i < count; i++)
+                    if (pred(get(i)))
+                        return i;
+                return -1;
+            }
+            int split = GAP ? std::max(from, gapStart) : count;
+            for (int i = from; i < split; i++)
+                if (pred(buf[i]))
+                    return i;
+            BT * tail = buf + bufSize - count;
+            for (int i = split; i < count; i++)
+                if (pred(tail[i]))
+                    return i;
+            return -1;
+        }
+
+        // contiguous view of the elements
+        BT * data()
+        {
+            thaw();
+            closeGap();
+            return buf;
+        }
+
+        // read-only contiguous view; a packed block is decoded into scratch (MAX_SIZE elements) and stays packed
+        const BT * view(BT * scratch)
+        {
+            if constexpr (packable)
+                if (packed != nullptr)
+                {
+                    BTreeVectorScan::unpack(scratch, packed, packedBytes(packedBits), count, packedBits, packedBase);
+                    return scratch;
+                }
+            closeGap();
+            return buf;
+        }
+
+        // Replaces the buffer with values stored as (value - min) in the fewest bits that fit.
+        // Returns false if the block cannot be packed or packing would not save memory.
+        bool pack()
+        {
+            if constexpr (packable)
+            {
+                typedef typename std::make_unsigned<BT>::type U;
+                if (packed != nullptr)
+                    return true;
+                if (count == 0)
+                    return false;
+                closeGap();
+                BT lo = buf[0], hi = buf[0];
+                for (int i = 1; i < count; i++)
+                {
+                    lo = std::min(lo, buf[i]);
+                    hi = std::max(hi, buf[i]);
+                }
+                uint64_t range = (U) ((U) hi - (U) lo);
+                int bits = 0;
+                while (bits < 64 && (range >> bits) != 0)
+                    bits++;
+                // one unaligned 64-bit word must hold a value at any bit offset
+                if (bits > 56 || bits >= (int) sizeof(BT) * 8)
+                    return false;
+                uint8_t * p = (uint8_t*) calloc(packedBytes(bits), 1);
+                assert(p != nullptr);
+                for (int i = 0; i < count; i++)
+                {
+                    size_t bit = (size_t) i * bits;
+                    uint64_t w;
+                    memcpy(&w, p + (bit >> 3), sizeof(w));
+                    w |= ((uint64_t) (U) ((U) buf[i] - (U) lo)) << (bit & 7);
+                    memcpy(p + (bit >> 3), &w, sizeof(w));
+                }
+                free(orgBuf);
+                orgBuf = buf = nullptr;
+                bufSize = 0;
+                packed = p;
+                packedBase = (U) lo;
+                packedBits = bits;
+                return true;
+            }
+            return false;
+        }
+
+        inline bool isPacked()
+        {
+            return packed != nullptr;
+        }
+
+        // trims the buffer to the element count
+        void shrink()
+        {
+            if (packed != nullptr || (count == bufSize && buf == orgBuf))
+                return;
+            closeGap();
+            int newSize = std::max(count, 1);
+            BT * newBuf;
+            if constexpr (BT_IS_TRIVIAL)
+            {
+                if (buf != orgBuf)
+                    xmemmove(orgBuf, buf, count);
+                newBuf = (BT*) realloc(orgBuf, newSize * sizeof(BT));
+                assert(newBuf != nullptr);
+            } else
+            {
+                newBuf = new BT[newSize];
+                xmemmove(newBuf, buf, count);
+                delete[] orgBuf;
+            }
+            orgBuf = buf = newBuf;
+            bufSize = newSize;
+        }
+
+        size_t memoryUsage()
+        {
+            if (packed != nullptr)
+                return sizeof(*this) + packedBytes(packedBits);
+            return sizeof(*this) + (bufSize + (buf - orgBuf)) * sizeof(BT);
+        }
+
     private:
+        inline int phys(int idx)
+        {
+            return GAP && idx >= gapStart ? idx + bufSize - count : idx;
+        }
+
+        void moveGap(int idx)
+        {
+            if constexpr (GAP)
+            {
+                int gap = bufSize - count;
+                if (gap > 0)
+                {
+                    if (idx < gapStart)
+                        xmemmove(&buf[idx + gap], &buf[idx], gapStart - idx, true);
+                    else if (idx > gapStart)
+                        xmemmove(&buf[gapStart], &buf[gapStart + gap], idx - gapStart);
+                }
+                gapStart = idx;
+            }
+        }
+
+        inline void closeGap()
+        {
+            moveGap(count);
+        }
+
+        inline void thaw()
+        {
+            if (packable && packed != nullptr)
+                unpack();
+        }
+
+        inline size_t packedBytes(int bits)
+        {
+            // trailing word keeps the last unaligned read inside the allocation
+            return ((size_t) count * bits + 7) / 8 + sizeof(uint64_t);
+        }
+
+        // decodes up to PACKED_CHUNK elements from first, a multiple of 8, and returns their number
+        inline int unpackChunk(BT * out, int first)
+        {
+            int n = std::min(PACKED_CHUNK, count - first);
+            // a group of 8 fields starts at a byte boundary
+            size_t at = (size_t) (first >> 3) * packedBits;
+            BTreeVectorScan::unpack(out, packed + at, packedBytes(packedBits) - at, n, packedBits, packedBase);
+            return n;
+        }
+
+        inline uint64_t unpackDeltaAt(int idx)
+        {
+            size_t bit = (size_t) idx * packedBits;
+            uint64_t w;
+            memcpy(&w, packed + (bit >> 3), sizeof(w));
+            uint64_t mask = (((uint64_t) 1) << packedBits) - 1;
+            return (w >> (bit & 7)) & mask;
+        }
+
+        inline BT unpackAt(int idx)
+        {
+            typedef typename std::make_unsigned<BT>::type U;
+            return (BT) (U) (packedBase + unpackDeltaAt(idx));
+        }
+
+        // the delta a value would be packed as, false if it is outside the block's range
+        inline bool packedDelta(const BT & value, uint64_t & delta)
+        {
+            typedef typename std::make_unsigned<BT>::type U;
+            delta = (U) ((U) value - (U) packedBase);
+            return (delta >> packedBits) == 0;
+        }
+
+        void unpack()
+        {
+            if constexpr (packable)
+            {
+                bufSize = std::max(count, MAX_SIZE >> 1);
+                orgBuf = buf = (BT*) malloc(bufSize * sizeof(BT));
+                assert(buf != nullptr);
+                BTreeVectorScan::unpack(buf, packed, packedBytes(packedBits), count, packedBits, packedBase);
+                free(packed);
+                packed = nullptr;
+                if constexpr (GAP)
+                    gapStart = count;
+            }
+        }
+
         void ensure(int size)
         {
             if (size <= bufSize)
                 return;
+            closeGap();
             int newSize = std::min(MAX_SIZE, std::max(size, bufSize * INCREASE_PRC / 100));
             assert(newSize >= size);
             xrealloc(newSize);
@@ -149,7 +680,7 @@ class BTreeVectorImpl
             } else
             {
                 BT * newBuf;
-                if (BT_IS_TRIVIAL)
+                if constexpr (BT_IS_TRIVIAL)
                 {
                     if (diff)
                     {
@@ -175,7 +706,7 @@ class BTreeVectorImpl
 
         void xmemmove(BT * dst, BT * src, int cnt, bool reverse = false)
         {
-            if (BT_IS_TRIVIAL)
+            if constexpr (BT_IS_TRIVIAL)
                 memmove(dst, src, cnt * sizeof(BT));
             else if (reverse)
                 xreversemove(src, cnt, dst);
@@ -185,6 +716,7 @@ class BTreeVectorImpl
 
         void expand(int from, int cnt)
         {
+            closeGap();
             ensure(count + cnt);
             if (from < count)
                 xmemmove(&buf[from + cnt], &buf[from], (count - from), true);
@@ -204,10 +736,230 @@ class BTreeVectorImpl
 
     };
 
+    // one DataBlock per field of a tuple-like BT
+    template<typename BT, int MAX_SIZE, typename FIELDS>
+    struct ColumnBlocks;
+
+    template<typename BT, int MAX_SIZE, size_t ... I>
+    struct ColumnBlocks<BT, MAX_SIZE, std::index_sequence<I...>>
+    {
+        typedef std::tuple<DataBlock<typename std::tuple_element<I, BT>::type, std::is_pod<typename std::tuple_element<I, BT>::type>::value, 200,
+                MAX_SIZE>...> type;
+    };
+
+    // Leaf block of the Columnar layout: a DataBlock per field, all edited in step.
+    // Fields are read with get<I>() found by std:: or argument-dependent lookup, elements are rebuilt with BT{fields...}.
+    template<typename BT, int MAX_SIZE>
+    struct ColumnDataBlock
+    {
+    private:
+        typedef ColumnDataBlock<BT, MAX_SIZE> ThisDataBlock;
+        typedef std::make_index_sequence<std::tuple_size<BT>::value> Fields;
+        typename ColumnBlocks<BT, MAX_SIZE, Fields>::type columns;
+
+        template<typename OP>
+        inline void each(OP op)
+        {
+            std::apply([&op](auto & ... column)
+            {
+                (op(column), ...);
+            }, columns);
+        }
+
+        template<size_t ... I>
+        inline BT getFields(int idx, std::index_sequence<I...>)
+        {
+            return BT { std::get<I>(columns).get(idx)... };
+        }
+
+        template<size_t ... I>
+        inline void addFields(int idx, BT & element, std::index_sequence<I...>)
+        {
+            using std::get;
+            (std::get<I>(columns).add(idx, std::move(get<I>(element))), ...);
+        }
+
+        template<size_t ... I>
+        inline void setFields(int idx, BT & element, std::index_sequence<I...>)
+        {
+            using std::get;
+            (std::get<I>(columns).set(idx, std::move(get<I>(element))), ...);
+        }
+
+        template<size_t ... I>
+        inline void insertFields(ThisDataBlock * dst, int from, int to, int cnt, std::index_sequence<I...>)
+        {
+            (std::get<I>(columns).insertRange(&std::get<I>(dst->columns), from, to, cnt), ...);
+        }
+
+        template<size_t ... I>
+        inline bool equalsFrom(int idx, const BT & value, std::index_sequence<I...>)
+        {
+            using std::get;
+            return ((std::get<I + 1>(columns).get(idx) == get<I + 1>(value)) && ...);
+        }
+
+        // the first column is searched with the leaf scans, the others checked per candidate
+        inline bool restEqual(int idx, const BT & value)
+        {
+            return equalsFrom(idx, value, std::make_index_sequence<std::tuple_size<BT>::value - 1>());
+        }
+
+    public:
+
+        inline BT get(int idx)
+        {
+            return getFields(idx, Fields());
+        }
+
+        template<int I>
+        inline typename std::tuple_element<I, BT>::type getField(int idx)
+        {
+            return std::get<I>(columns).get(idx);
+        }
+
+        // contiguous view of one field, thaws a frozen column
+        template<int I>
+        inline typename std::tuple_element<I, BT>::type * column()
+        {
+            return std::get<I>(columns).data();
+        }
+
+        // read-only view of one field; a frozen column is decoded into scratch and stays packed
+        template<int I>
+        inline const typename std::tuple_element<I, BT>::type * columnView(typename std::tuple_element<I, BT>::type * scratch)
+        {
+            return std::get<I>(columns).view(scratch);
+        }
+
+        inline int size()
+        {
+            return std::get<0>(columns).size();
+        }
+
+        void add(BT element)
+        {
+            addFields(size(), element, Fields());
+        }
+
+        void add(int idx, BT element)
+        {
+            addFields(idx, element, Fields());
+        }
+
+        void addFront(BT element)
+        {
+            addFields(0, element, Fields());
+        }
+
+        void set(int idx, BT element)
+        {
+            setFields(idx, element, Fields());
+        }
+
+        BT exchange(int idx, BT element)
+        {
+            BT old = get(idx);
+            setFields(idx, element, Fields());
+            return old;
+        }
+
+        void remove(int idx)
+        {
+            each([idx](auto & column)
+            {
+                column.remove(idx);
+            });
+        }
+
+        void insertRange(ThisDataBlock * dst, int from, int to, int cnt)
+        {
+            insertFields(dst, from, to, cnt, Fields());
+        }
+
+        void removeRange(int start, int cnt)
+        {
+            each([start, cnt](auto & column)
+            {
+                column.removeRange(start, cnt);
+            });
+        }
+
+        int indexOf(const BT & value, int from)
+        {
+            using std::get;
+            for (int idx = from;; idx++)
+            {
+                idx = std::get<0>(columns).indexOf(get<0>(value), idx);
+                if (idx < 0 || restEqual(idx, value))
+                    return idx;
+            }
+        }
+
+        // searches [0, to)
+        int lastIndexOf(const BT & value, int to)
+        {
+            using std::get;
+            for (int idx = to;;)
+            {
+                idx = std::get<0>(columns).lastIndexOf(get<0>(value), idx);
+                if (idx < 0 || restEqual(idx, value))
+                    return idx;
+            }
+        }
+
+        int countOf(const BT & value)
+        {
+            int cnt = 0;
+            for (int idx = 0; (idx = indexOf(value, idx)) >= 0; idx++)
+                cnt++;
+            return cnt;
+        }
+
+        template<typename P>
+        int findIf(P & pred, int from)
+        {
+            for (int i = from; i < size(); i++)
+                if (pred(get(i)))
+                    return i;
+            return -1;
+        }
+
+        // packs the integral columns
+        bool pack()
+        {
+            bool packed = false;
+            each([&packed](auto & column)
+            {
+                packed |= column.pack();
+            });
+            return packed;
+        }
+
+        void shrink()
+        {
+            each([](auto & column)
+            {
+                column.shrink();
+            });
+        }
+
+        size_t memoryUsage()
+        {
+            size_t total = 0;
+            each([&total](auto & column)
+            {
+                total += column.memoryUsage();
+            });
+            return total;
+        }
+    };
+
     struct Node
     {
         typedef DataBlock<Node *, true, 200, MAX_NODE_BLOCK_SIZE> InternalNodeDataBlock;
-        typedef DataBlock<T, std::is_pod<T>::value, 200, MAX_LEAF_BLOCK_SIZE> LeafDataBlock;
+        typedef typename std::conditional<LEAF_LAYOUT == BTreeLeafLayout::Columnar, ColumnDataBlock<T, MAX_LEAF_BLOCK_SIZE>,
+                DataBlock<T, std::is_pod<T>::value, 200, MAX_LEAF_BLOCK_SIZE, LEAF_LAYOUT == BTreeLeafLayout::GapBuffer>>::type LeafDataBlock;
 
         union Data
         {
@@ -216,6 +968,8 @@ class BTreeVectorImpl
         } data;
         int count = 0;
         bool isLeaf;
+        // kept up to date only while handles are in use
+        Node * parent = nullptr;
 
         Node(bool isLeaf)
         {
@@ -310,15 +1064,12 @@ class BTreeVectorImpl
                     }
                 }
             }
-            std::cerr << "index out of range: " << pos << "\n";
-            throw;
+            btreeVectorOutOfRange(pos, node->count);
         }
     };
 
     struct Path
     {
-        PathNode * pn = nullptr;
-        Node * child = nullptr;
         BTreeVectorImpl * bta;
         PathNode * pathRoot = nullptr;
     public:
@@ -334,8 +1085,8 @@ class BTreeVectorImpl
         Path * getPathNodes(int pos)
         {
             position = pos;
-            child = bta->root;
-            pn = pathRoot;
+            Node * child = bta->root;
+            PathNode * pn = pathRoot;
             for (;;)
             {
                 if (pn == nullptr)
@@ -353,25 +1104,551 @@ class BTreeVectorImpl
                 if (child == nullptr)
                     break;
                 pos = pn->countedPos;
+                pathLeaf = pn; // tail for nodes appended below
                 pn = pn->nextDown;
             }
             pathLeaf = pn;
             return this;
         }
 
-        ~Path()
+        ~Path()
+        {
+            while (pathRoot != nullptr)
+            {
+                PathNode * pn = pathRoot;
+                pathRoot = pathRoot->nextDown;
+                delete pn;
+            }
+        }
+
+    };
+
+// --- BTreeVectorImpl
+
+    template<typename F>
+    void forEachLeaf(Node * node, F & f)
+    {
+        if (node->isLeaf)
+            f(node);
+        else
+            for (int i = 0; i < node->csize(); i++)
+                forEachLeaf(node->data.childrenNodes->get(i), f);
+    }
+
+    // Calls f(data, count) with span(leaf) of every leaf, in order. The next leaf's span is looked up and
+    // prefetched before f runs on the current one: a leaf buffer is too short for the hardware prefetcher
+    // to catch up, so a plain walk would wait on every cache line of it.
+    template<typename S, typename F>
+    void forEachLeafSpan(S span, F & f)
+    {
+        decltype(span(root)) data = nullptr;
+        int count = -1;
+        auto g = [&span, &f, &data, &count](Node * leaf)
+        {
+            auto next = span(leaf);
+            for (size_t b = 0; b < leaf->count * sizeof(*next); b += 64)
+                __builtin_prefetch((const char *) next + b);
+            if (count >= 0)
+                f(data, count);
+            data = next;
+            count = leaf->count;
+        };
+        forEachLeaf(root, g);
+        if (count >= 0)
+            f(data, count);
+    }
+
+    // Recursive scans, base is the position of the node's first element
+
+    int findInNode(Node * node, int base, int from, const T & value)
+    {
+        if (node->isLeaf)
+        {
+            int idx = node->data.childrenValues->indexOf(value, std::max(0, from - base));
+            return idx < 0 ? -1 : base + idx;
+        }
+        for (int i = 0; i < node->csize(); i++)
+        {
+            Node * child = node->data.childrenNodes->get(i);
+            if (base + child->count > from)
+            {
+                int pos = findInNode(child, base, from, value);
+                if (pos >= 0)
+                    return pos;
+            }
+            base += child->count;
+        }
+        return -1;
+    }
+
+    // searches positions up to and including last; base is the position past the node's last element
+    int rfindInNode(Node * node, int base, int last, const T & value)
+    {
+        if (node->isLeaf)
+        {
+            int first = base - node->count;
+            int idx = node->data.childrenValues->lastIndexOf(value, std::min(node->count, last - first + 1));
+            return idx < 0 ? -1 : first + idx;
+        }
+        for (int i = node->csize() - 1; i >= 0; i--)
+        {
+            Node * child = node->data.childrenNodes->get(i);
+            if (base - child->count <= last)
+            {
+                int pos = rfindInNode(child, base, last, value);
+                if (pos >= 0)
+                    return pos;
+            }
+            base -= child->count;
+        }
+        return -1;
+    }
+
+    template<typename F>
+    int findIfInNode(Node * node, int base, int from, F & pred)
+    {
+        if (node->isLeaf)
+        {
+            int idx = node->data.childrenValues->findIf(pred, std::max(0, from - base));
+            return idx < 0 ? -1 : base + idx;
+        }
+        for (int i = 0; i < node->csize(); i++)
+        {
+            Node * child = node->data.childrenNodes->get(i);
+            if (base + child->count > from)
+            {
+                int pos = findIfInNode(child, base, from, pred);
+                if (pos >= 0)
+                    return pos;
+            }
+            base += child->count;
+        }
+        return -1;
+    }
+
+    size_t nodeMemoryUsage(Node * node)
+    {
+        if (node->isLeaf)
+            return sizeof(Node) + node->data.childrenValues->memoryUsage();
+        size_t total = sizeof(Node) + node->data.childrenNodes->memoryUsage();
+        for (int i = 0; i < node->csize(); i++)
+            total += nodeMemoryUsage(node->data.childrenNodes->get(i));
+        return total;
+    }
+
+    void deleteInternalNodes(Node * node)
+    {
+        if (node->isLeaf)
+            return;
+        for (int i = 0; i < node->csize(); i++)
+            deleteInternalNodes(node->data.childrenNodes->get(i));
+        delete node;
+    }
+
+    // number of children a block of maxSize holds at fillFactor, never below half full
+    static int fillCount(float fillFactor, int maxSize)
+    {
+        int fill = (int) (fillFactor * maxSize + 0.5f);
+        return std::min(maxSize, std::max(maxSize >> 1, fill));
+    }
+
+    // blocks to spread size children over evenly: about size / fill, but none below half of maxSize,
+    // since a lone underfull block has no sibling to merge with later
+    static int blockCount(int size, int fill, int maxSize)
+    {
+        return std::max(1, std::min((size + fill - 1) / fill, size / (maxSize >> 1)));
+    }
+
+    // builds the internal levels above the given nodes bottom-up, returns the new root
+    Node * buildLevels(std::vector<Node *> & level, int fill)
+    {
+        if (level.empty())
+            return new Node(true);
+        while (level.size() > 1)
+        {
+            int size = level.size();
+            int blocks = blockCount(size, fill, MAX_NODE_BLOCK_SIZE);
+            std::vector<Node *> upper;
+            upper.reserve(blocks);
+            for (int b = 0, idx = 0; b < blocks; b++)
+            {
+                int cnt = size / blocks + (b < size % blocks);
+                Node * node = new Node(false);
+                for (int i = 0; i < cnt; i++, idx++)
+                {
+                    node->data.childrenNodes->add(level[idx]);
+                    node->count += level[idx]->count;
+                    level[idx]->parent = node;
+                }
+                upper.push_back(node);
+            }
+            level.swap(upper);
+        }
+        level[0]->parent = nullptr;
+        return level[0];
+    }
+
+    // Repacks the leaves under the lowest internal node of the path into new leaves
+    // allocated in order. Returns the number of elements from the path position to the end of that node.
+    int compactLeaves(Path * path, int fill)
+    {
+        PathNode * pn = path->pathLeaf->parent;
+        if (pn == nullptr)
+            return root->count - path->pathLeaf->childIdx;
+        Node * parent = pn->node;
+        int passed = path->pathLeaf->childIdx;
+        for (int i = 0; i < pn->childIdx; i++)
+            passed += parent->data.childrenNodes->get(i)->count;
+        int total = parent->count;
+        int oldLeaves = parent->csize();
+        // a parent keeps two leaves, until rebuildInternalLevels() regroups them a lone leaf could not merge
+        int leaves = std::max(std::min(2, oldLeaves), blockCount(total, fill, MAX_LEAF_BLOCK_SIZE));
+        if (leaves < oldLeaves)
+        {
+            structModCount++;
+            std::vector<Node *> newLeaves;
+            newLeaves.reserve(leaves);
+            int srcIdx = 0, srcFrom = 0;
+            for (int b = 0; b < leaves; b++)
+            {
+                int need = total / leaves + (b < total % leaves);
+                Node * leaf = new Node(true);
+                while (need > 0)
+                {
+                    Node * src = parent->data.childrenNodes->get(srcIdx);
+                    int cnt = std::min(need, src->count - srcFrom);
+                    // chunks are taken from the front of src, so its remaining handles start at 0
+                    moveAnchors(src, 0, leaf, leaf->count, cnt);
+                    src->data.childrenValues->insertRange(leaf->data.childrenValues, srcFrom, leaf->count, cnt);
+                    leaf->count += cnt;
+                    need -= cnt;
+                    srcFrom += cnt;
+                    if (srcFrom == src->count)
+                    {
+                        srcIdx++;
+                        srcFrom = 0;
+                    }
+                }
+                newLeaves.push_back(leaf);
+            }
+            for (int i = 0; i < oldLeaves; i++)
+                delete parent->data.childrenNodes->get(i);
+            parent->data.childrenNodes->removeRange(0, oldLeaves);
+            for (Node * leaf : newLeaves)
+            {
+                parent->data.childrenNodes->add(leaf);
+                leaf->parent = parent;
+            }
+        }
+        return total - passed;
+    }
+
+    void rebuildInternalLevels(int fill)
+    {
+        if (root->isLeaf)
+            return;
+        std::vector<Node *> leaves;
+        auto f = [&leaves](Node * leaf)
+        {
+            leaves.push_back(leaf);
+        };
+        forEachLeaf(root, f);
+        deleteInternalNodes(root);
+        root = buildLevels(leaves, fill);
+        structModCount++;
+    }
+
+    void shrinkInternalNodes(Node * node)
+    {
+        if (node->isLeaf)
+            return;
+        node->data.childrenNodes->shrink();
+        for (int i = 0; i < node->csize(); i++)
+            shrinkInternalNodes(node->data.childrenNodes->get(i));
+    }
+
+    // Calls f for the leaves from position cursor on, until maxElements (0 - no limit) elements are passed.
+    // Returns true and resets the cursor when the end of the tree is reached.
+    template<typename F>
+    bool stepLeaves(int & cursor, int maxElements, F & f)
+    {
+        int passed = 0;
+        while (cursor < (int) root->count)
+        {
+            if (maxElements > 0 && passed >= maxElements)
+                return false;
+            int n = f(findPath(cursor));
+            cursor += n;
+            passed += n;
+        }
+        cursor = 0;
+        return true;
+    }
+
+    // LSD radix sort of integral keys; passes over bytes equal in all keys are skipped
+    static void radixSort(T * data, int n, T * tmp)
+    {
+        typedef typename std::make_unsigned<T>::type U;
+        const U signBit = std::is_signed<T>::value ? (U) 1 << (sizeof(T) * 8 - 1) : 0;
+        T * src = data, *dst = tmp;
+        for (unsigned shift = 0; shift < sizeof(T) * 8; shift += 8)
+        {
+            int bucket[257] = { 0 };
+            for (int i = 0; i < n; i++)
+                bucket[((((U) src[i]) ^ signBit) >> shift & 0xff) + 1]++;
+            if (bucket[((((U) src[0]) ^ signBit) >> shift & 0xff) + 1] == n)
+                continue;
+            for (int b = 0; b < 256; b++)
+                bucket[b + 1] += bucket[b];
+            for (int i = 0; i < n; i++)
+                dst[bucket[(((U) src[i]) ^ signBit) >> shift & 0xff]++] = src[i];
+            std::swap(src, dst);
+        }
+        if (src != data)
+            memcpy(data, src, n * sizeof(T));
+    }
+
+    // integral keys in ascending order go through radixSort, bool excluded
+    template<typename Compare>
+    static constexpr bool radixSorted()
+    {
+        return std::is_integral<T>::value && !std::is_same<T, bool>::value && std::is_same<Compare, std::less<T>>::value;
+    }
+
+    template<typename Compare>
+    static void sortBlock(T * data, int n, Compare & comp, bool stable, T * tmp)
+    {
+        if constexpr (radixSorted<Compare>())
+        {
+            if (n > 0)
+                radixSort(data, n, tmp);
+        } else if (stable)
+            std::stable_sort(data, data + n, comp);
+        else
+            std::sort(data, data + n, comp);
+    }
+
+    // Sorts runs of consecutive leaves in parallel, then merges the runs into new full leaves
+    // and rebuilds the internal levels. Source leaves are freed as soon as the merge drains them.
+    // A run holds about 256k elements: enough to keep the merge shallow, little next to the tree itself.
+    template<typename Compare>
+    void sortLeaves(Compare comp, bool stable)
+    {
+        static_assert(LEAF_LAYOUT != BTreeLeafLayout::Columnar, "sorting needs a row layout");
+        syncEdges();
+        dropAnchors();
+        const int SORT_RUN_LEAVES = std::max(1, (1 << 18) / MAX_LEAF_BLOCK_SIZE);
+        std::vector<Node *> leaves;
+        auto collect = [&leaves](Node * leaf)
+        {
+            leaves.push_back(leaf);
+        };
+        forEachLeaf(root, collect);
+        int leafCount = leaves.size();
+        int runCount = (leafCount + SORT_RUN_LEAVES - 1) / SORT_RUN_LEAVES;
+        std::vector<T *> heads(leafCount);
+        for (int i = 0; i < leafCount; i++)
+            heads[i] = leaves[i]->data.childrenValues->data();
+
+        // plain arrays, a std::vector<bool> has no data()
+        int runCapacity = std::min(root->count, SORT_RUN_LEAVES * MAX_LEAF_BLOCK_SIZE);
+        auto sortRuns = [&](int from, int to)
+        {
+            std::unique_ptr<T[]> run(new T[runCapacity]), tmp(radixSorted<Compare>() ? new T[runCapacity] : nullptr);
+            for (int r = from; r < to; r++)
+            {
+                int first = r * SORT_RUN_LEAVES, last = std::min(leafCount, first + SORT_RUN_LEAVES);
+                int n = 0;
+                for (int i = first; i < last; i++)
+                    for (int j = 0; j < leaves[i]->count; j++)
+                        run[n++] = std::move(heads[i][j]);
+                sortBlock(run.get(), n, comp, stable, tmp.get());
+                for (int i = first, k = 0; i < last; i++)
+                    for (int j = 0; j < leaves[i]->count; j++)
+                        heads[i][j] = std::move(run[k++]);
+            }
+        };
+        int threads = std::min((int) std::thread::hardware_concurrency(), runCount);
+        if (threads > 1)
+        {
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++)
+                workers.emplace_back(sortRuns, runCount * t / threads, runCount * (t + 1) / threads);
+            for (auto & w : workers)
+                w.join();
+        } else
+            sortRuns(0, runCount);
+        structModCount++;
+        if (runCount <= 1)
+            return;
+
+        deleteInternalNodes(root);
+        int total = 0;
+        for (Node * leaf : leaves)
+            total += leaf->count;
+        // merge cursor of each run: current leaf and position in it
+        std::vector<int> curLeaf(runCount), curPos(runCount, 0);
+        auto skipDrained = [&](int r)
+        {
+            int last = std::min(leafCount, (r + 1) * SORT_RUN_LEAVES);
+            while (curLeaf[r] < last && curPos[r] == leaves[curLeaf[r]]->count)
+            {
+                delete leaves[curLeaf[r]++];
+                curPos[r] = 0;
+            }
+            return curLeaf[r] < last;
+        };
+        // min-heap of runs by head element, ties broken by run order for stability
+        auto after = [&](int a, int b)
+        {
+            T & ea = heads[curLeaf[a]][curPos[a]];
+            T & eb = heads[curLeaf[b]][curPos[b]];
+            return comp(eb, ea) || (!comp(ea, eb) && a > b);
+        };
+        std::vector<int> heap;
+        heap.reserve(runCount);
+        for (int r = 0; r < runCount; r++)
+        {
+            curLeaf[r] = r * SORT_RUN_LEAVES;
+            if (skipDrained(r))
+                heap.push_back(r);
+        }
+        std::make_heap(heap.begin(), heap.end(), after);
+
+        int blocks = (total + MAX_LEAF_BLOCK_SIZE - 1) / MAX_LEAF_BLOCK_SIZE;
+        std::vector<Node *> newLeaves;
+        newLeaves.reserve(blocks);
+        for (int b = 0; b < blocks; b++)
+        {
+            Node * leaf = new Node(true);
+            int cnt = total / blocks + (b < total % blocks);
+            for (int i = 0; i < cnt; i++)
+            {
+                std::pop_heap(heap.begin(), heap.end(), after);
+                int r = heap.back();
+                leaf->data.childrenValues->add(std::move(heads[curLeaf[r]][curPos[r]++]));
+                if (skipDrained(r))
+                    std::push_heap(heap.begin(), heap.end(), after);
+                else
+                    heap.pop_back();
+            }
+            leaf->count = cnt;
+            newLeaves.push_back(leaf);
+        }
+        root = buildLevels(newLeaves, MAX_NODE_BLOCK_SIZE);
+    }
+
+// --- handle maintenance, skipped while no handle is attached to an element
+
+    inline bool anchored()
+    {
+        return handles != nullptr && handles->live > 0;
+    }
+
+    // ids of the handles into leaf, nullptr if there are none
+    std::vector<int> * leafAnchors(Node * leaf)
+    {
+        auto it = handles->leafAnchors.find(leaf);
+        return it != handles->leafAnchors.end() ? &it->second : nullptr;
+    }
+
+    // handles into leaf at from and above move by diff
+    void shiftAnchors(Node * leaf, int from, int diff)
+    {
+        if (!anchored())
+            return;
+        std::vector<int> * ids = leafAnchors(leaf);
+        if (ids == nullptr)
+            return;
+        for (int id : *ids)
+            if (handles->anchors[id].idx >= from)
+                handles->anchors[id].idx += diff;
+    }
+
+    // follows elements [from, from + cnt) of src moved to dst at to; the rest of src moves down by cnt
+    void moveAnchors(Node * src, int from, Node * dst, int to, int cnt)
+    {
+        if (!anchored())
+            return;
+        shiftAnchors(dst, to, cnt);
+        std::vector<int> * ids = leafAnchors(src);
+        if (ids == nullptr)
+            return;
+        for (size_t i = 0; i < ids->size();)
+        {
+            int id = (*ids)[i];
+            Anchor & a = handles->anchors[id];
+            if (a.idx >= from + cnt)
+                a.idx -= cnt;
+            else if (a.idx >= from)
+            {
+                a.leaf = dst;
+                a.idx += to - from;
+                attachAnchor(id);
+                (*ids)[i] = ids->back();
+                ids->pop_back();
+                continue;
+            }
+            i++;
+        }
+        // src may be deleted now, a new leaf at its address must not inherit the entry
+        if (ids->empty())
+            handles->leafAnchors.erase(src);
+    }
+
+    void attachAnchor(int id)
+    {
+        handles->leafAnchors[handles->anchors[id].leaf].push_back(id);
+    }
+
+    // leaves an empty entry behind, the caller erases it
+    void detachAnchor(std::vector<int> * ids, int id)
+    {
+        *std::find(ids->begin(), ids->end(), id) = ids->back();
+        ids->pop_back();
+        handles->anchors[id].leaf = nullptr;
+        handles->live--;
+    }
+
+    // the element at idx of leaf is removed
+    void removeAnchor(Node * leaf, int idx)
+    {
+        std::vector<int> * ids = leafAnchors(leaf);
+        if (ids == nullptr)
+            return;
+        for (size_t i = 0; i < ids->size();)
+            if (handles->anchors[(*ids)[i]].idx == idx)
+                detachAnchor(ids, (*ids)[i]);
+            else
+                i++;
+        if (ids->empty())
+            handles->leafAnchors.erase(leaf);
+        else
+            shiftAnchors(leaf, idx, -1);
+    }
+
+    // every handle loses its element
+    void dropAnchors()
+    {
+        if (!anchored())
+            return;
+        for (Anchor & a : handles->anchors)
+            a.leaf = nullptr;
+        handles->leafAnchors.clear();
+        handles->live = 0;
+    }
+
+    void linkParents(Node * node)
+    {
+        if (node->isLeaf)
+            return;
+        for (int i = 0; i < node->csize(); i++)
         {
-            while (pathRoot != nullptr)
-            {
-                PathNode * pn = pathRoot;
-                pathRoot = pathRoot->nextDown;
-                delete pn;
-            }
+            Node * child = node->data.childrenNodes->get(i);
+            child->parent = node;
+            linkParents(child);
         }
-
-    };
-
-// --- BTreeVectorImpl
+    }
 
     void deleteNodes(Node * node, int level)
     {
@@ -384,15 +1661,19 @@ class BTreeVectorImpl
     void splitAdd(Node * node, int pos, Node * moveUpNode, T & element)
     {
         if (node->isLeaf)
+        {
+            shiftAnchors(node, pos, 1);
             node->data.childrenValues->add(pos, element);
-        else
+        } else
         {
             assert(moveUpNode != nullptr);
             node->data.childrenNodes->add(pos, moveUpNode);
+            moveUpNode->parent = node;
         }
     }
 
-    Node * splitAndInsert(Node * moveUpNode, PathNode * pn, T & element)
+    // edge: -1/1 when inserting at the start/end of the vector, 0 otherwise
+    Node * splitAndInsert(Node * moveUpNode, PathNode * pn, T & element, int edge)
     {
         int MAXSIZE = pn->node->maxBlockSize();
         int pos = pn->node->isLeaf ? pn->childIdx : pn->childIdx + 1;
@@ -402,15 +1683,17 @@ class BTreeVectorImpl
             return nullptr;
         }
         int HALFSIZE = pn->node->halfBlockSize();
+        // an edge leaf stays full and the element gets a leaf of its own, so appends and prepends fill leaves
+        int splitAt = pn->node->isLeaf && edge != 0 ? (edge > 0 ? MAXSIZE : 0) : HALFSIZE;
         // split
         structModCount++;
         Node * newNode = new Node(pn->node->isLeaf);
-        move(pn->node, HALFSIZE, newNode, 0, pn->node->csize() - HALFSIZE, -1, nullptr);
-        if (pos < HALFSIZE)
+        move(pn->node, splitAt, newNode, 0, pn->node->csize() - splitAt, -1, nullptr);
+        if (pos < splitAt || splitAt == 0)
             splitAdd(pn->node, pos, moveUpNode, element);
         else
         {
-            splitAdd(newNode, pos - HALFSIZE, moveUpNode, element);
+            splitAdd(newNode, pos - splitAt, moveUpNode, element);
             int moveCount = pn->node->isLeaf ? 1 : moveUpNode->count;
             newNode->count += moveCount;
             pn->node->count -= moveCount;
@@ -422,16 +1705,28 @@ class BTreeVectorImpl
             root->data.childrenNodes->add(pn->node);
             root->data.childrenNodes->add(newNode);
             root->count = pn->node->count + newNode->count;
+            pn->node->parent = newNode->parent = root;
             //printf("new root %p\n", root);
         }
         return newNode;
     }
 
+    // size below which a block is rebalanced after a delete; internal nodes always keep two children
+    inline int minBlockSize(Node * node)
+    {
+        int least = node->isLeaf ? 1 : 2;
+        if (rebalance == BTreeRebalance::Eager)
+            return node->halfBlockSize();
+        if (rebalance == BTreeRebalance::Relaxed)
+            return std::max(least, node->maxBlockSize() >> 2);
+        return least;
+    }
+
     bool mergeBlocksAfterDelete(Node * node, Node * parent, int myParentIdx)
     {
         int HALFSIZE = node->halfBlockSize();
         int size = node->csize();
-        if (size >= HALFSIZE)
+        if (size >= minBlockSize(node))
             return false;
         int MAXSIZE = node->maxBlockSize();
         // merge left
@@ -449,18 +1744,19 @@ class BTreeVectorImpl
             return true;
         }
 
-        // borrow right
+        // borrow right; the relaxed policies take half the difference at once
+        bool even = rebalance != BTreeRebalance::Eager;
         int diff = HALFSIZE - size;
         if (right != nullptr && right->csize() > HALFSIZE)
         {
-            int avgCount = std::max(diff, (right->csize() - HALFSIZE) >> 1);
+            int avgCount = even ? (right->csize() - size) >> 1 : std::max(diff, (right->csize() - HALFSIZE) >> 1);
             move(right, 0, node, size, avgCount, -1, nullptr);
             return true;
         }
         // borrow left
         if (left != nullptr && left->csize() > HALFSIZE)
         {
-            int avgCount = std::max(diff, (left->csize() - HALFSIZE) >> 1);
+            int avgCount = even ? (left->csize() - size) >> 1 : std::max(diff, (left->csize() - HALFSIZE) >> 1);
             move(left, left->csize() - avgCount, node, 0, avgCount, -1, nullptr);
             return true;
         }
@@ -473,13 +1769,19 @@ class BTreeVectorImpl
         int moveCount = 0;
         if (src->isLeaf)
         {
+            moveAnchors(src, from, dst, to, cnt);
             src->data.childrenValues->insertRange(dst->data.childrenValues, from, to, cnt);
             moveCount += cnt;
         } else
         {
             src->data.childrenNodes->insertRange(dst->data.childrenNodes, from, to, cnt);
             for (int i = from; i < from + cnt; i++)
-                moveCount += src->data.childrenNodes->get(i)->count;
+            {
+                Node * child = src->data.childrenNodes->get(i);
+                moveCount += child->count;
+                if (anchored())
+                    child->parent = dst;
+            }
         }
         dst->count += moveCount;
         if (parent != nullptr)
@@ -498,14 +1800,18 @@ class BTreeVectorImpl
         }
     }
 
-    Path * getPath(const int pos, const int fromAdd = 0)
+    inline Path * getPath(const int pos, const int fromAdd = 0)
     {
+        syncEdges();
+        if ((unsigned) pos >= (unsigned) (root->count + fromAdd))
+            btreeVectorOutOfRange(pos, root->count + fromAdd);
+        return findPath(pos);
+    }
 
-        if (pos >= root->count + fromAdd || pos < 0)
-        {
-            std::cerr << "index " << pos << " out of range 0:" << (root->count - 1 + fromAdd) << "\n";
-            throw;
-        }
+    // getPath without the range check, pos must be within 0:size()
+    inline Path * findPath(const int pos)
+    {
+        syncEdges();
         if (cachePath.modCount == structModCount) // try get from cache
         {
             int diff = pos - cachePath.position;
@@ -526,68 +1832,452 @@ class BTreeVectorImpl
         return cachePath.getPathNodes(pos);
     }
 
+    inline bool isInline()
+    {
+        if constexpr (INLINE_CAPACITY > 0)
+            return root == nullptr;
+        return false;
+    }
+
+    inline T & inlineAt(int pos)
+    {
+        if ((unsigned) pos >= (unsigned) small.count)
+            btreeVectorOutOfRange(pos, small.count);
+        return small.items()[pos];
+    }
+
+    // moves the inline elements into a newly allocated root leaf
+    void buildTree()
+    {
+        root = new Node(true);
+        T * items = small.items();
+        for (int i = 0; i < small.count; i++)
+            root->data.childrenValues->add(std::move(items[i]));
+        root->count = small.count;
+        small.clear();
+        structModCount++;
+    }
+
     BTreeVectorImpl()
     {
-        this->root = new Node(true);
+        this->root = INLINE_CAPACITY > 0 ? nullptr : new Node(true);
     }
 
     ~BTreeVectorImpl()
     {
-        deleteNodes(root, 0);
+        delete[] edges;
+        delete handles;
+        if (isInline())
+            small.clear();
+        else
+            deleteNodes(root, 0);
     }
 
     void clear()
     {
-        deleteNodes(root, 0);
-        root = new Node(true);
+        syncEdges();
+        dropAnchors();
+        if (isInline())
+            small.clear();
+        else
+        {
+            deleteNodes(root, 0);
+            root = INLINE_CAPACITY > 0 ? nullptr : new Node(true);
+        }
         structModCount++;
     }
 
     inline unsigned size()
     {
-        return root->count;
+        syncEdges();
+        return isInline() ? small.count : root->count;
+    }
+
+    // packs every leaf of an integral T, returns the number of packed leaves;
+    // a packed leaf is unpacked again by the first write or reference taken into it
+    int freeze()
+    {
+        if (isInline())
+            return 0;
+        int frozen = 0;
+        auto f = [&frozen](Node * leaf)
+        {
+            if (leaf->data.childrenValues->pack())
+                frozen++;
+        };
+        forEachLeaf(root, f);
+        return frozen;
+    }
+
+    size_t memoryUsage()
+    {
+        size_t side = edges != nullptr ? 2 * sizeof(EdgePath) : 0;
+        if (handles != nullptr)
+        {
+            // a hash node holds the entry and a next pointer
+            side += sizeof(HandleTable) + handles->anchors.capacity() * sizeof(Anchor)
+                    + handles->freeAnchors.capacity() * sizeof(int)
+                    + handles->leafAnchors.bucket_count() * sizeof(void *)
+                    + handles->leafAnchors.size() * (sizeof(typename decltype(handles->leafAnchors)::value_type) + sizeof(void *));
+            for (auto & e : handles->leafAnchors)
+                side += e.second.capacity() * sizeof(int);
+        }
+        if (isInline())
+            return sizeof(*this) + side;
+        return sizeof(*this) + side + nodeMemoryUsage(root);
+    }
+
+    // Repacks leaves to fillFactor and then rebuilds the internal levels, all in allocation order.
+    // With maxElements > 0 at most about that many elements are repacked per call, and the call
+    // returns false until the pass is complete.
+    bool compact(float fillFactor = 1.0f, int maxElements = 0)
+    {
+        if (isInline())
+            return true;
+        syncEdges();
+        int fill = fillCount(fillFactor, MAX_LEAF_BLOCK_SIZE);
+        auto f = [this, fill](Path * path)
+        {
+            return compactLeaves(path, fill);
+        };
+        if (!stepLeaves(compactPos, maxElements, f))
+            return false;
+        rebuildInternalLevels(fillCount(fillFactor, MAX_NODE_BLOCK_SIZE));
+        return true;
+    }
+
+    // position of the first element equal to value at or after from, -1 if none
+    int find(const T & value, int from = 0)
+    {
+        if (isInline())
+            return BTreeVectorScan::findFirst(small.items(), std::max(0, from), small.count, value);
+        syncEdges();
+        return findInNode(root, 0, std::max(0, from), value);
+    }
+
+    // position of the last element equal to value at or before from (-1 - from the end), -1 if none
+    int rfind(const T & value, int from = -1)
+    {
+        if (isInline())
+            return BTreeVectorScan::findLast(small.items(), 0, from < 0 || from >= small.count ? small.count : from + 1, value);
+        syncEdges();
+        if (from < 0 || from >= root->count)
+            from = root->count - 1;
+        return rfindInNode(root, root->count, from, value);
+    }
+
+    int count(const T & value)
+    {
+        if (isInline())
+            return BTreeVectorScan::count(small.items(), 0, small.count, value);
+        int cnt = 0;
+        auto f = [&cnt, &value](Node * leaf)
+        {
+            cnt += leaf->data.childrenValues->countOf(value);
+        };
+        forEachLeaf(root, f);
+        return cnt;
+    }
+
+    template<typename F>
+    int find_if(F pred, int from = 0)
+    {
+        if (isInline())
+        {
+            for (int i = std::max(0, from); i < small.count; i++)
+                if (pred(small.items()[i]))
+                    return i;
+            return -1;
+        }
+        syncEdges();
+        return findIfInNode(root, 0, std::max(0, from), pred);
+    }
+
+    template<typename Compare = std::less<T>>
+    void sort(Compare comp = Compare())
+    {
+        if (isInline())
+            std::sort(small.items(), small.items() + small.count, comp);
+        else
+            sortLeaves(comp, false);
+    }
+
+    template<typename Compare = std::less<T>>
+    void stable_sort(Compare comp = Compare())
+    {
+        if (isInline())
+            std::stable_sort(small.items(), small.items() + small.count, comp);
+        else
+            sortLeaves(comp, true);
+    }
+
+    void setRebalance(BTreeRebalance policy)
+    {
+        rebalance = policy;
+    }
+
+    // Trims block buffers to their element count, incrementally like compact()
+    bool shrink_to_fit(int maxElements = 0)
+    {
+        if (isInline())
+            return true;
+        syncEdges();
+        auto f = [](Path * path)
+        {
+            Node * leaf = path->pathLeaf->node;
+            leaf->data.childrenValues->shrink();
+            return leaf->count - path->pathLeaf->childIdx;
+        };
+        if (!stepLeaves(shrinkPos, maxElements, f))
+            return false;
+        shrinkInternalNodes(root);
+        return true;
     }
 
     T get(int pos)
     {
+        if (isInline())
+            return inlineAt(pos);
         Path * path = getPath(pos);
-        return path->pathLeaf->node->data.childrenValues->getRef(path->pathLeaf->childIdx);
+        return path->pathLeaf->node->data.childrenValues->get(path->pathLeaf->childIdx);
     }
 
+    // unchecked, asserted in debug builds
     T & operator[](int pos)
     {
+        static_assert(LEAF_LAYOUT != BTreeLeafLayout::Columnar, "the Columnar layout has no element references, use get() and set()");
+        assert(pos >= 0 && pos < (int) size() && "BTreeVector index out of range");
+        if (isInline())
+            return small.items()[pos];
+        Path * path = findPath(pos);
+        return path->pathLeaf->node->data.childrenValues->getRef(path->pathLeaf->childIdx);
+    }
+
+    T & at(int pos)
+    {
+        static_assert(LEAF_LAYOUT != BTreeLeafLayout::Columnar, "the Columnar layout has no element references, use get() and set()");
+        if (isInline())
+            return inlineAt(pos);
         Path * path = getPath(pos);
         return path->pathLeaf->node->data.childrenValues->getRef(path->pathLeaf->childIdx);
     }
 
+    // returns the replaced element
     T set(int pos, T element)
     {
+        if (isInline())
+        {
+            T old = std::move(inlineAt(pos));
+            small.items()[pos] = std::move(element);
+            return old;
+        }
+        Path * path = getPath(pos);
+        return path->pathLeaf->node->data.childrenValues->exchange(path->pathLeaf->childIdx, element);
+    }
+
+    typedef int Handle;
+
+    // handle to the element at pos, valid until released
+    Handle handle(int pos)
+    {
+        if (isInline())
+            buildTree();
+        Path * path = getPath(pos);
+        if (handles == nullptr)
+            handles = new HandleTable();
+        if (handles->live++ == 0)
+        {
+            root->parent = nullptr;
+            linkParents(root);
+        }
+        int id;
+        if (handles->freeAnchors.empty())
+        {
+            id = handles->anchors.size();
+            handles->anchors.push_back(Anchor());
+        } else
+        {
+            id = handles->freeAnchors.back();
+            handles->freeAnchors.pop_back();
+        }
+        handles->anchors[id].leaf = path->pathLeaf->node;
+        handles->anchors[id].idx = path->pathLeaf->childIdx;
+        attachAnchor(id);
+        return id;
+    }
+
+    // a handle that was returned by handle() and not released yet
+    inline bool heldHandle(Handle h)
+    {
+        return handles != nullptr && (unsigned) h < handles->anchors.size() && handles->anchors[h].idx >= 0;
+    }
+
+    // current position of the handle's element in O(log n), -1 if it was removed (by remove, clear or sort)
+    // or the handle is not held
+    int position_of(Handle h)
+    {
+        if (!heldHandle(h))
+            return -1;
+        syncEdges();
+        Anchor & a = handles->anchors[h];
+        if (a.leaf == nullptr)
+            return -1;
+        int pos = a.idx;
+        for (Node * node = a.leaf; node->parent != nullptr; node = node->parent)
+        {
+            typename Node::InternalNodeDataBlock * siblings = node->parent->data.childrenNodes;
+            for (int i = 0; siblings->get(i) != node; i++)
+                pos += siblings->get(i)->count;
+        }
+        return pos;
+    }
+
+    // releasing a handle that is not held is a no-op, so a second release cannot free the id twice
+    void release(Handle h)
+    {
+        if (!heldHandle(h))
+            return;
+        Node * leaf = handles->anchors[h].leaf;
+        if (leaf != nullptr)
+        {
+            std::vector<int> * ids = leafAnchors(leaf);
+            detachAnchor(ids, h);
+            if (ids->empty())
+                handles->leafAnchors.erase(leaf);
+        }
+        handles->anchors[h].idx = -1;
+        handles->freeAnchors.push_back(h);
+    }
+
+    // Columnar layout: one field of the element at pos
+    template<int I>
+    typename std::tuple_element<I, T>::type getField(int pos)
+    {
+        using std::get;
+        if (isInline())
+            return get<I>(inlineAt(pos));
         Path * path = getPath(pos);
-        return path->pathLeaf->node->data.childrenValues->set(path->pathLeaf->childIdx, element);
+        return path->pathLeaf->node->data.childrenValues->template getField<I>(path->pathLeaf->childIdx);
+    }
+
+    // Columnar layout: calls f(fieldData, count) with the contiguous values of field I of every leaf, in order.
+    // Each leaf is a separate block, so the saving over a row scan nears the record/field width only with
+    // large leaves: for an int field of a 32-byte record it is about 4.5x at MAX_LEAF_BLOCK_SIZE 4096, under 2x at 128.
+    template<int I, typename F>
+    void forEachColumn(F f)
+    {
+        using std::get;
+        if (isInline())
+        {
+            for (int i = 0; i < small.count; i++)
+                f(&get<I>(small.items()[i]), 1);
+            return;
+        }
+        auto span = [](Node * leaf)
+        {
+            return leaf->data.childrenValues->template column<I>();
+        };
+        forEachLeafSpan(span, f);
+    }
+
+    // Columnar layout: forEachColumn for reading, with f(const Field * data, count); frozen columns are decoded into a buffer
+    template<int I, typename F>
+    void forEachConstColumn(F f)
+    {
+        typedef typename std::tuple_element<I, T>::type Field;
+        using std::get;
+        if (isInline())
+        {
+            for (int i = 0; i < small.count; i++)
+                f((const Field *) &get<I>(small.items()[i]), 1);
+            return;
+        }
+        std::unique_ptr<Field[]> scratch(std::is_integral<Field>::value && !std::is_same<Field, bool>::value ? new Field[MAX_LEAF_BLOCK_SIZE] : nullptr);
+        auto g = [&f, &scratch](Node * leaf)
+        {
+            f(leaf->data.childrenValues->template columnView<I>(scratch.get()), leaf->count);
+        };
+        forEachLeaf(root, g);
+    }
+
+    // row layouts: calls f(data, count) with the contiguous elements of every leaf, in order
+    template<typename F>
+    void forEachSpan(F f)
+    {
+        static_assert(LEAF_LAYOUT != BTreeLeafLayout::Columnar, "the Columnar layout stores no rows, use forEachColumn()");
+        if (isInline())
+        {
+            f(small.items(), small.count);
+            return;
+        }
+        auto span = [](Node * leaf)
+        {
+            return leaf->data.childrenValues->data();
+        };
+        forEachLeafSpan(span, f);
+    }
+
+    // row layouts: forEachSpan for reading, with f(const T * data, count); frozen leaves are decoded into a buffer
+    template<typename F>
+    void forEachConstSpan(F f)
+    {
+        static_assert(LEAF_LAYOUT != BTreeLeafLayout::Columnar, "the Columnar layout stores no rows, use forEachConstColumn()");
+        if (isInline())
+        {
+            f((const T *) small.items(), small.count);
+            return;
+        }
+        // packed leaves are decoded here; not a std::vector, which has no data() for bool
+        std::unique_ptr<T[]> scratch(std::is_integral<T>::value && !std::is_same<T, bool>::value ? new T[MAX_LEAF_BLOCK_SIZE] : nullptr);
+        auto g = [&f, &scratch](Node * leaf)
+        {
+            f(leaf->data.childrenValues->view(scratch.get()), leaf->count);
+        };
+        forEachLeaf(root, g);
     }
 
     void add(T element)
     {
-        add(root->count, element);
+        add(size(), element);
     }
 
     void add(int pos, T element)
     {
+        if (isInline())
+        {
+            if ((unsigned) pos > (unsigned) small.count)
+                btreeVectorOutOfRange(pos, small.count + 1);
+            if (small.count < INLINE_CAPACITY)
+            {
+                small.add(pos, element);
+                return;
+            }
+            buildTree();
+        }
         Path * path = getPath(pos, 1);
+        int edge = pos == 0 ? -1 : pos == root->count ? 1 : 0;
         Node * moveUpNode = nullptr;
         PathNode * pn = path->pathLeaf;
         do
         {
             pn->node->count++;
             if (moveUpNode != nullptr || pn->node->isLeaf)
-                moveUpNode = splitAndInsert(moveUpNode, pn, element);
+                moveUpNode = splitAndInsert(moveUpNode, pn, element, edge);
             pn = pn->parent;
         } while (pn != nullptr);
     }
 
     void remove(int pos)
     {
+        if (isInline())
+        {
+            inlineAt(pos);
+            small.remove(pos);
+            return;
+        }
         Path * path = getPath(pos);
+        if (anchored())
+            removeAnchor(path->pathLeaf->node, path->pathLeaf->childIdx);
         path->pathLeaf->node->data.childrenValues->remove(path->pathLeaf->childIdx);
         bool merge = true;
         PathNode * pn = path->pathLeaf;
@@ -603,11 +2293,302 @@ class BTreeVectorImpl
         {
             Node * oldroot = root;
             root = root->data.childrenNodes->get(0);
+            root->parent = nullptr;
             delete oldroot;
             structModCount++;
         }
     }
 
+// --- leaf-local operations for concurrent writers (see ConcurrentBTreeVector)
+// The caller holds its thread slot and latches the leaf, so only the leaf contents and the counts change.
+// Counts below the root are exact and adjusted atomically. Every write would change the root count, so
+// it is kept per slot instead (rootDiff) and added to the root before the next structural change;
+// the shared descent sums the root's children and never reads it.
+
+    const static int MAX_SHARED_DEPTH = 32;
+
+    static inline int loadCount(Node * node)
+    {
+        return __atomic_load_n(&node->count, __ATOMIC_RELAXED);
+    }
+
+    static inline void addCounts(Node ** nodes, int depth, int diff, int & rootDiff)
+    {
+        if (depth == 1)
+        {
+            // a root leaf is exact, only its latch holder writes it
+            __atomic_store_n(&nodes[0]->count, nodes[0]->count + diff, __ATOMIC_RELAXED);
+            return;
+        }
+        for (int i = 1; i < depth; i++)
+            __atomic_fetch_add(&nodes[i]->count, diff, __ATOMIC_RELAXED);
+        __atomic_store_n(&rootDiff, rootDiff + diff, __ATOMIC_RELAXED);
+    }
+
+    // called with every slot held
+    void flushRootCount(int & rootDiff)
+    {
+        root->count += rootDiff;
+        __atomic_store_n(&rootDiff, 0, __ATOMIC_RELAXED);
+    }
+
+    // Fills nodes with the path from the root to the leaf holding pos and returns its depth,
+    // pos becomes the (unchecked) index in the leaf, INT_MAX if it was past the end.
+    // Returns -1 if the shared path cannot be used.
+    int descendShared(int & pos, Node ** nodes)
+    {
+        if (pos < 0)
+            return -1;
+        int depth = 0;
+        Node * node = root;
+        nodes[depth++] = node;
+        bool end = false;
+        if (node->isLeaf)
+            end = pos >= loadCount(node);
+        else
+        {
+            // the root count lags behind, the first level is scanned from the front
+            typename Node::InternalNodeDataBlock * children = node->data.childrenNodes;
+            int size = children->size();
+            for (int i = 0; i < size; i++)
+            {
+                node = children->get(i);
+                int cnt = loadCount(node);
+                if (pos < cnt)
+                    break;
+                end = i == size - 1;
+                pos -= cnt;
+            }
+            nodes[depth++] = node;
+        }
+        while (!node->isLeaf)
+        {
+            if (depth == MAX_SHARED_DEPTH)
+                return -1;
+            typename Node::InternalNodeDataBlock * children = node->data.childrenNodes;
+            int size = children->size();
+            int total = loadCount(node);
+            pos = std::min(pos, total);
+            // from the nearer end, like PathNode::findChild
+            if (end)
+                node = children->get(size - 1);
+            else if (pos > total >> 1)
+            {
+                int sum = total;
+                for (int i = size - 1; i >= 0; i--)
+                {
+                    node = children->get(i);
+                    sum -= loadCount(node);
+                    if (sum <= pos || i == 0)
+                        break;
+                }
+                // counts change under concurrent writers, the sum may not reach 0
+                pos = std::max(0, pos - sum);
+            } else
+                for (int i = 0; i < size; i++)
+                {
+                    node = children->get(i);
+                    int cnt = loadCount(node);
+                    if (pos < cnt || i == size - 1)
+                        break;
+                    pos -= cnt;
+                }
+            nodes[depth++] = node;
+        }
+        if (end)
+            pos = INT_MAX;
+        return depth;
+    }
+
+    // adds to the leaf if it needs no split; INT_MAX appends
+    bool addShared(Node ** nodes, int depth, int pos, T & element, int & rootDiff)
+    {
+        Node * leaf = nodes[depth - 1];
+        int size = leaf->csize();
+        if (pos == INT_MAX)
+            pos = size;
+        if (size >= MAX_LEAF_BLOCK_SIZE || pos > size)
+            return false;
+        leaf->data.childrenValues->add(pos, element);
+        addCounts(nodes, depth, 1, rootDiff);
+        return true;
+    }
+
+    // removes from the leaf into removed if it needs no merge
+    bool removeShared(Node ** nodes, int depth, int pos, T & removed, int & rootDiff)
+    {
+        Node * leaf = nodes[depth - 1];
+        if (pos >= leaf->csize() || (depth > 1 && leaf->csize() <= minBlockSize(leaf)))
+            return false;
+        removed = leaf->data.childrenValues->get(pos);
+        leaf->data.childrenValues->remove(pos);
+        addCounts(nodes, depth, -1, rootDiff);
+        return true;
+    }
+
+// --- deque operations: the first and last leaves are reached through pinned paths, valid while the structure
+// is unchanged. Only the edge leaf's count changes until the leaf fills up or is about to empty; then the
+// general add/remove splits it or merges it away. The counts above the leaf are left behind in pending and
+// applied by syncEdges() before anything reads them. Edge leaves may drain below half: a non-root leaf always
+// has a sibling, so the merge on its last element still finds one.
+
+    struct EdgePath
+    {
+        Node * leaf = nullptr; // nodes[depth - 1]
+        int modCount = -1;
+        int pending = 0; // count change not yet applied to nodes[0..depth - 2]
+        int depth = 0;
+        Node * nodes[MAX_SHARED_DEPTH];
+    };
+
+    // path from the root along the first or last children, nullptr if the tree is too deep
+    EdgePath * edgePath(bool last)
+    {
+        if (edges == nullptr)
+            edges = new EdgePath[2];
+        EdgePath * e = &edges[last];
+        if (e->modCount != structModCount)
+        {
+            assert(e->pending == 0 && "structure changed before the edge counts were synced");
+            Node * node = root;
+            e->depth = 0;
+            e->nodes[e->depth++] = node;
+            while (!node->isLeaf)
+            {
+                if (e->depth == MAX_SHARED_DEPTH)
+                    return nullptr;
+                node = node->data.childrenNodes->get(last ? node->csize() - 1 : 0);
+                e->nodes[e->depth++] = node;
+            }
+            e->leaf = node;
+            e->modCount = structModCount;
+        }
+        return e;
+    }
+
+    static inline void addEdgeCounts(EdgePath * e, int diff)
+    {
+        e->leaf->count += diff;
+        e->pending += diff;
+    }
+
+    // applies the pending counts of both edge paths; the internal counts and size() are exact afterwards
+    inline void syncEdges()
+    {
+        if (edges != nullptr && (edges[0].pending | edges[1].pending) != 0)
+            flushEdges();
+    }
+
+    // a path with nothing pending may be stale, its nodes are not touched
+    void flushEdges()
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            EdgePath * e = &edges[k];
+            if (e->pending == 0)
+                continue;
+            for (int i = 0; i < e->depth - 1; i++)
+                e->nodes[i]->count += e->pending;
+            e->pending = 0;
+        }
+    }
+
+    // leaf a pop may take from without merging
+    static inline bool canPop(EdgePath * e)
+    {
+        return e->leaf->count > (e->depth > 1 ? 1 : 0);
+    }
+
+    // positions shifted under the cached path
+    inline void dropCachedPath()
+    {
+        cachePath.modCount = -1;
+    }
+
+    void push_back(T element)
+    {
+        EdgePath * e;
+        if (isInline() || (e = edgePath(true)) == nullptr || e->leaf->count == MAX_LEAF_BLOCK_SIZE)
+        {
+            add(size(), element);
+            return;
+        }
+        e->leaf->data.childrenValues->add(element);
+        addEdgeCounts(e, 1);
+    }
+
+    void push_front(T element)
+    {
+        EdgePath * e;
+        if (isInline() || (e = edgePath(false)) == nullptr || e->leaf->count == MAX_LEAF_BLOCK_SIZE)
+        {
+            add(0, element);
+            return;
+        }
+        Node * leaf = e->leaf;
+        shiftAnchors(leaf, 0, 1);
+        leaf->data.childrenValues->addFront(element);
+        addEdgeCounts(e, 1);
+        dropCachedPath();
+    }
+
+    void pop_back()
+    {
+        EdgePath * e;
+        if (isInline() || (e = edgePath(true)) == nullptr || !canPop(e))
+        {
+            remove(size() - 1);
+            return;
+        }
+        Node * leaf = e->leaf;
+        if (anchored())
+            removeAnchor(leaf, leaf->count - 1);
+        leaf->data.childrenValues->remove(leaf->count - 1);
+        addEdgeCounts(e, -1);
+    }
+
+    void pop_front()
+    {
+        EdgePath * e;
+        if (isInline() || (e = edgePath(false)) == nullptr || !canPop(e))
+        {
+            remove(0);
+            return;
+        }
+        Node * leaf = e->leaf;
+        if (anchored())
+            removeAnchor(leaf, 0);
+        leaf->data.childrenValues->remove(0);
+        addEdgeCounts(e, -1);
+        dropCachedPath();
+    }
+
+    T front()
+    {
+        if (isInline())
+            return inlineAt(0);
+        EdgePath * e = edgePath(false);
+        if (e == nullptr)
+            return get(0);
+        Node * leaf = e->leaf;
+        if (leaf->count == 0)
+            btreeVectorOutOfRange(0, 0);
+        return leaf->data.childrenValues->get(0);
+    }
+
+    T back()
+    {
+        if (isInline())
+            return inlineAt(small.count - 1);
+        EdgePath * e = edgePath(true);
+        if (e == nullptr)
+            return get(size() - 1);
+        Node * leaf = e->leaf;
+        if (leaf->count == 0)
+            btreeVectorOutOfRange(-1, 0);
+        return leaf->data.childrenValues->get(leaf->count - 1);
+    }
+
 };
 
 #endif /* BTREEVECTORIMPL_H_ */
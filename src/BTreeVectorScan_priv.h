@@ -0,0 +1,302 @@
+/*
+ * Author: appdevsw@wp.pl
+ *
+ */
+
+#ifndef BTREEVECTORSCAN_H_
+#define BTREEVECTORSCAN_H_
+
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+
+// SSE2/AVX2 equality scans over contiguous element ranges and the AVX2 decoder of bit-packed
+// leaves, used by the leaf blocks.
+// The scans use what the build targets: SSE2 on any x86-64 build, AVX2 with -mavx2. The decoder is
+// compiled for AVX2 either way on x86 GCC/Clang and chosen at run time if the CPU supports it.
+// Define BTREEVECTOR_NO_SIMD to use the scalar loops only.
+#if !defined(BTREEVECTOR_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define BTREEVECTOR_SIMD 2
+#elif !defined(BTREEVECTOR_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define BTREEVECTOR_SIMD 1
+#endif
+
+#if !defined(BTREEVECTOR_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BTREEVECTOR_AVX2_UNPACK
+#ifdef __AVX2__
+#define BTREEVECTOR_AVX2_TARGET
+#else
+#define BTREEVECTOR_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+struct BTreeVectorScan
+{
+    // element types compared lane-wise; float and double use the ordered-equal compare, which like
+    // == finds no NaN and takes -0.0 equal to +0.0
+    template<typename V>
+    static constexpr bool vectorized()
+    {
+#ifdef BTREEVECTOR_SIMD
+        return (std::is_integral<V>::value && !std::is_same<V, bool>::value) || std::is_same<V, float>::value
+                || std::is_same<V, double>::value;
+#else
+        return false;
+#endif
+    }
+
+    // bits of an eqMask() per lane: integer compares yield one per byte, floating point one per element
+    template<typename V>
+    static constexpr int laneBits()
+    {
+        return std::is_floating_point<V>::value ? 1 : sizeof(V);
+    }
+
+    // without -mpopcnt __builtin_popcount is a library call
+    static inline int bitCount(uint32_t m)
+    {
+#ifdef __POPCNT__
+        return __builtin_popcount(m);
+#else
+        m = m - ((m >> 1) & 0x55555555);
+        m = (m & 0x33333333) + ((m >> 2) & 0x33333333);
+        return (((m + (m >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#endif
+    }
+
+#if BTREEVECTOR_SIMD == 2
+    typedef __m256i Vec;
+
+    static inline Vec load(const void * p)
+    {
+        return _mm256_loadu_si256((const Vec *) p);
+    }
+
+    template<typename V>
+    static inline Vec splat(const V & v)
+    {
+        if constexpr (std::is_same<V, float>::value)
+            return _mm256_castps_si256(_mm256_set1_ps(v));
+        else if constexpr (std::is_same<V, double>::value)
+            return _mm256_castpd_si256(_mm256_set1_pd(v));
+        else if constexpr (sizeof(V) == 1)
+            return _mm256_set1_epi8((char) v);
+        else if constexpr (sizeof(V) == 2)
+            return _mm256_set1_epi16((short) v);
+        else if constexpr (sizeof(V) == 4)
+            return _mm256_set1_epi32((int) v);
+        else
+            return _mm256_set1_epi64x((long long) v);
+    }
+
+    // laneBits<V>() bits per lane, set for equal lanes
+    template<typename V>
+    static inline uint32_t eqMask(Vec a, Vec b)
+    {
+        if constexpr (std::is_same<V, float>::value)
+            return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _CMP_EQ_OQ));
+        else if constexpr (std::is_same<V, double>::value)
+            return (uint32_t) _mm256_movemask_pd(_mm256_cmp_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _CMP_EQ_OQ));
+        else if constexpr (sizeof(V) == 1)
+            return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        else if constexpr (sizeof(V) == 2)
+            return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi16(a, b));
+        else if constexpr (sizeof(V) == 4)
+            return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, b));
+        else
+            return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi64(a, b));
+    }
+#elif BTREEVECTOR_SIMD == 1
+    typedef __m128i Vec;
+
+    static inline Vec load(const void * p)
+    {
+        return _mm_loadu_si128((const Vec *) p);
+    }
+
+    template<typename V>
+    static inline Vec splat(const V & v)
+    {
+        if constexpr (std::is_same<V, float>::value)
+            return _mm_castps_si128(_mm_set1_ps(v));
+        else if constexpr (std::is_same<V, double>::value)
+            return _mm_castpd_si128(_mm_set1_pd(v));
+        else if constexpr (sizeof(V) == 1)
+            return _mm_set1_epi8((char) v);
+        else if constexpr (sizeof(V) == 2)
+            return _mm_set1_epi16((short) v);
+        else if constexpr (sizeof(V) == 4)
+            return _mm_set1_epi32((int) v);
+        else
+            return _mm_set1_epi64x((long long) v);
+    }
+
+    template<typename V>
+    static inline uint32_t eqMask(Vec a, Vec b)
+    {
+        if constexpr (std::is_same<V, float>::value)
+            return (uint32_t) _mm_movemask_ps(_mm_cmpeq_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b)));
+        else if constexpr (std::is_same<V, double>::value)
+            return (uint32_t) _mm_movemask_pd(_mm_cmpeq_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b)));
+        else if constexpr (sizeof(V) == 1)
+            return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        else if constexpr (sizeof(V) == 2)
+            return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi16(a, b));
+        else if constexpr (sizeof(V) == 4)
+            return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi32(a, b));
+        else
+        {
+            // SSE2 has no 64-bit compare: both 32-bit halves must match
+            Vec c = _mm_cmpeq_epi32(a, b);
+            c = _mm_and_si128(c, _mm_shuffle_epi32(c, _MM_SHUFFLE(2, 3, 0, 1)));
+            return (uint32_t) _mm_movemask_epi8(c);
+        }
+    }
+#endif
+
+    // index of the first element in [from, to) equal to value, -1 if none
+    template<typename V>
+    static int findFirst(const V * data, int from, int to, const V & value)
+    {
+        int i = from;
+#ifdef BTREEVECTOR_SIMD
+        if constexpr (vectorized<V>())
+        {
+            const int LANES = sizeof(Vec) / sizeof(V);
+            Vec needle = splat(value);
+            for (; i + LANES <= to; i += LANES)
+            {
+                uint32_t m = eqMask<V>(load(data + i), needle);
+                if (m != 0)
+                    return i + __builtin_ctz(m) / laneBits<V>();
+            }
+        }
+#endif
+        for (; i < to; i++)
+            if (data[i] == value)
+                return i;
+        return -1;
+    }
+
+    // index of the last element in [from, to) equal to value, -1 if none
+    template<typename V>
+    static int findLast(const V * data, int from, int to, const V & value)
+    {
+        int i = to;
+#ifdef BTREEVECTOR_SIMD
+        if constexpr (vectorized<V>())
+        {
+            const int LANES = sizeof(Vec) / sizeof(V);
+            Vec needle = splat(value);
+            for (; i - LANES >= from; i -= LANES)
+            {
+                uint32_t m = eqMask<V>(load(data + i - LANES), needle);
+                if (m != 0)
+                    return i - LANES + (31 - __builtin_clz(m)) / laneBits<V>();
+            }
+        }
+#endif
+        while (--i >= from)
+            if (data[i] == value)
+                return i;
+        return -1;
+    }
+
+    // number of elements in [from, to) equal to value
+    template<typename V>
+    static int count(const V * data, int from, int to, const V & value)
+    {
+        int cnt = 0;
+        int i = from;
+#ifdef BTREEVECTOR_SIMD
+        if constexpr (vectorized<V>())
+        {
+            const int LANES = sizeof(Vec) / sizeof(V);
+            Vec needle = splat(value);
+            for (; i + LANES <= to; i += LANES)
+                cnt += bitCount(eqMask<V>(load(data + i), needle));
+            cnt /= laneBits<V>();
+        }
+#endif
+        for (; i < to; i++)
+            cnt += data[i] == value;
+        return cnt;
+    }
+
+    // Decodes n values stored as (value - base) in bits-wide fields at consecutive bit offsets.
+    // bytes is the size of packed, which must hold a 64-bit word read at the byte of any field.
+    template<typename V>
+    static void unpack(V * out, const uint8_t * packed, size_t bytes, int n, int bits, uint64_t base)
+    {
+        typedef typename std::make_unsigned<V>::type U;
+        int i = 0;
+#ifdef BTREEVECTOR_AVX2_UNPACK
+        if constexpr (sizeof(V) == 4 || sizeof(V) == 8)
+            if (bits <= 25 && hasAvx2())
+                i = unpackGroups(out, packed, bytes, n, bits, base);
+#else
+        (void) bytes;
+#endif
+        uint64_t mask = (((uint64_t) 1) << bits) - 1;
+        for (; i < n; i++)
+        {
+            size_t bit = (size_t) i * bits;
+            uint64_t w;
+            memcpy(&w, packed + (bit >> 3), sizeof(w));
+            out[i] = (V) (U) (base + ((w >> (bit & 7)) & mask));
+        }
+    }
+
+#ifdef BTREEVECTOR_AVX2_UNPACK
+    static inline bool hasAvx2()
+    {
+#ifdef __AVX2__
+        return true;
+#else
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+#endif
+    }
+
+    // Eight fields per step: a group of eight starts at a byte boundary and takes bits bytes.
+    // Each 128-bit half is loaded from the byte of its first field, shuffled to one field per
+    // 32-bit lane and shifted into place; a field of up to 25 bits fits a lane at any bit offset.
+    // Returns the number of values decoded, the rest is left to the scalar loop.
+    template<typename V>
+    BTREEVECTOR_AVX2_TARGET static int unpackGroups(V * out, const uint8_t * packed, size_t bytes, int n, int bits, uint64_t base)
+    {
+        int half = (4 * bits) >> 3;
+        // bit offset of each field in its half, then the four bytes from its first byte and the shift left over
+        __m256i bit = _mm256_sub_epi32(_mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(bits)),
+                _mm256_setr_epi32(0, 0, 0, 0, half * 8, half * 8, half * 8, half * 8));
+        __m256i vshuffle = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(bit, 3), _mm256_set1_epi32(0x01010101)),
+                _mm256_set1_epi32(0x03020100));
+        __m256i vshifts = _mm256_and_si256(bit, _mm256_set1_epi32(7));
+        __m256i mask = _mm256_set1_epi32((int) ((((uint64_t) 1) << bits) - 1));
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            size_t at = (size_t) (i >> 3) * bits;
+            if (at + half + 16 > bytes)
+                break;
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (packed + at))),
+                    _mm_loadu_si128((const __m128i *) (packed + at + half)), 1);
+            v = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(v, vshuffle), vshifts), mask);
+            if constexpr (sizeof(V) == 4)
+                _mm256_storeu_si256((__m256i *) (out + i), _mm256_add_epi32(v, _mm256_set1_epi32((int) base)));
+            else
+            {
+                __m256i vbase = _mm256_set1_epi64x((long long) base);
+                _mm256_storeu_si256((__m256i *) (out + i), _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)), vbase));
+                _mm256_storeu_si256((__m256i *) (out + i + 4), _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)), vbase));
+            }
+        }
+        return i;
+    }
+#endif
+};
+
+#endif /* BTREEVECTORSCAN_H_ */
@@ -0,0 +1,213 @@
+/*
+ * Author: appdevsw@wp.pl
+ *
+ */
+
+#ifndef SRC_CONCURRENTBTREEVECTOR_H_
+#define SRC_CONCURRENTBTREEVECTOR_H_
+
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include "BTreeVectorImpl_priv.h"
+
+// BTreeVector for several writers working on different regions of one sequence.
+// Operations that stay inside one leaf (no split or merge) run in parallel. Each thread works under
+// the lock of its own slot and latches only its leaf. Counts on the way change atomically, except the
+// root's: each slot keeps its share of it, so threads in different regions write no common cache line.
+// Operations that split or merge blocks take every slot and run the usual single-writer code.
+// A position is resolved when the operation runs, so writers in earlier regions may shift it.
+template<typename T, int MAX_NODE_BLOCK_SIZE = 16, int MAX_LEAF_BLOCK_SIZE = 128, BTreeLeafLayout LEAF_LAYOUT = BTreeLeafLayout::Plain>
+class ConcurrentBTreeVector
+{
+private:
+    typedef BTreeVectorImpl<T, MAX_NODE_BLOCK_SIZE, MAX_LEAF_BLOCK_SIZE, LEAF_LAYOUT> Impl;
+    typedef typename Impl::Node Node;
+    const static int LATCH_COUNT = 256;
+
+    // one cache line each, so threads on different slots or leaves do not share lines
+    struct alignas(64) Slot
+    {
+        std::mutex lock;
+        // change of the root count by this slot's leaf-local writes
+        int rootDiff = 0;
+    };
+
+    struct alignas(64) Latch
+    {
+        std::mutex mutex;
+    };
+
+    Impl impl;
+    // slotMask + 1 slots, a power of two
+    int slotMask;
+    std::unique_ptr<Slot[]> slots;
+    // leaf latches, shared by leaves with the same hash
+    Latch latches[LATCH_COUNT];
+
+    inline std::mutex & latch(Node * leaf)
+    {
+        return latches[((uintptr_t) leaf / sizeof(Node)) % LATCH_COUNT].mutex;
+    }
+
+    // threads are numbered in the order of their first operation, so the first slotMask + 1 threads
+    // never share a slot
+    static unsigned threadIndex()
+    {
+        static std::atomic<unsigned> next(0);
+        thread_local unsigned index = next++;
+        return index;
+    }
+
+    inline Slot & slot()
+    {
+        return slots[threadIndex() & slotMask];
+    }
+
+    // Takes every slot in order and adds their shares to the root count, so the single-writer code sees
+    // exact counts. The path cache does not follow leaf-local writes, it is dropped.
+    struct Exclusive
+    {
+        ConcurrentBTreeVector * owner;
+
+        Exclusive(ConcurrentBTreeVector * owner)
+                : owner(owner)
+        {
+            for (int i = 0; i <= owner->slotMask; i++)
+                owner->slots[i].lock.lock();
+            for (int i = 0; i <= owner->slotMask; i++)
+                owner->impl.flushRootCount(owner->slots[i].rootDiff);
+            owner->impl.structModCount++;
+        }
+
+        ~Exclusive()
+        {
+            for (int i = owner->slotMask; i >= 0; i--)
+                owner->slots[i].lock.unlock();
+        }
+    };
+
+public:
+
+    ConcurrentBTreeVector()
+    {
+        // twice the hardware threads
+        unsigned count = 1;
+        while (count < 2 * std::max(1u, std::thread::hardware_concurrency()))
+            count <<= 1;
+        slotMask = count - 1;
+        slots.reset(new Slot[count]);
+    }
+
+    void clear()
+    {
+        Exclusive lock(this);
+        impl.clear();
+    }
+
+    // sums the slots' shares of the root count
+    unsigned size()
+    {
+        Slot & own = slot();
+        std::lock_guard<std::mutex> lock(own.lock);
+        int count = Impl::loadCount(impl.root);
+        for (int i = 0; i <= slotMask; i++)
+            count += __atomic_load_n(&slots[i].rootDiff, __ATOMIC_RELAXED);
+        return count;
+    }
+
+    T get(int pos)
+    {
+        {
+            Slot & own = slot();
+            std::lock_guard<std::mutex> lock(own.lock);
+            Node * nodes[Impl::MAX_SHARED_DEPTH];
+            int leafPos = pos;
+            int depth = impl.descendShared(leafPos, nodes);
+            if (depth > 0)
+            {
+                Node * leaf = nodes[depth - 1];
+                std::lock_guard<std::mutex> leafLock(latch(leaf));
+                if (leafPos < leaf->csize())
+                    return leaf->data.childrenValues->get(leafPos);
+            }
+        }
+        Exclusive lock(this);
+        return impl.get(pos);
+    }
+
+    // returns the replaced element
+    T set(int pos, T element)
+    {
+        {
+            Slot & own = slot();
+            std::lock_guard<std::mutex> lock(own.lock);
+            Node * nodes[Impl::MAX_SHARED_DEPTH];
+            int leafPos = pos;
+            int depth = impl.descendShared(leafPos, nodes);
+            if (depth > 0)
+            {
+                Node * leaf = nodes[depth - 1];
+                std::lock_guard<std::mutex> leafLock(latch(leaf));
+                if (leafPos < leaf->csize())
+                    return leaf->data.childrenValues->exchange(leafPos, element);
+            }
+        }
+        Exclusive lock(this);
+        return impl.set(pos, element);
+    }
+
+    // appends at the end of the sequence as seen when the operation runs
+    void add(T element)
+    {
+        add(INT_MAX, element);
+    }
+
+    // positions past the end append
+    void add(int pos, T element)
+    {
+        {
+            Slot & own = slot();
+            std::lock_guard<std::mutex> lock(own.lock);
+            Node * nodes[Impl::MAX_SHARED_DEPTH];
+            int leafPos = pos;
+            int depth = impl.descendShared(leafPos, nodes);
+            if (depth > 0)
+            {
+                std::lock_guard<std::mutex> leafLock(latch(nodes[depth - 1]));
+                if (impl.addShared(nodes, depth, leafPos, element, own.rootDiff))
+                    return;
+            }
+        }
+        Exclusive lock(this);
+        impl.add(std::min(pos, (int) impl.size()), element);
+    }
+
+    // returns the removed element; reading it with get() first would race with the other writers
+    T remove(int pos)
+    {
+        {
+            Slot & own = slot();
+            std::lock_guard<std::mutex> lock(own.lock);
+            Node * nodes[Impl::MAX_SHARED_DEPTH];
+            int leafPos = pos;
+            int depth = impl.descendShared(leafPos, nodes);
+            if (depth > 0)
+            {
+                std::lock_guard<std::mutex> leafLock(latch(nodes[depth - 1]));
+                T removed;
+                if (impl.removeShared(nodes, depth, leafPos, removed, own.rootDiff))
+                    return removed;
+            }
+        }
+        Exclusive lock(this);
+        T removed = impl.get(pos);
+        impl.remove(pos);
+        return removed;
+    }
+
+};
+
+#endif /* SRC_CONCURRENTBTREEVECTOR_H_ */
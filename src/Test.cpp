@@ -1,12 +1,21 @@
 #include <chrono>
 #include <sstream>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <iterator>
+#include <array>
+#include <cmath>
 #include <assert.h>
 #include <locale.h>
 #include <BTreeVector.h>
+#include <ConcurrentBTreeVector.h>
 
 #define BTASIZENODE 16
 #define BTASIZELEAF 128
+#define BTASIZELARGELEAF 4096
 
 #define dbgprintf if(0)printf
 
@@ -14,16 +23,28 @@
 
 #ifdef BTA_STRING_TEST
 #define toVal toValStr
+#define fromVal fromValStr
 #define BTATYPE std::string
 #define printtype "STRING"
 
 #else
 #define toVal toValInt
+#define fromVal fromValInt
 #define BTATYPE int
 #define printtype "INT"
 #endif
 
 typedef BTreeVector<BTATYPE, BTASIZENODE, BTASIZELEAF> BTAType;
+typedef BTreeVector<BTATYPE, BTASIZENODE, BTASIZELEAF, BTreeLeafLayout::GapBuffer> BTAGapType;
+typedef BTreeVector<BTATYPE, BTASIZENODE, BTASIZELARGELEAF> BTALargeType;
+typedef BTreeVector<BTATYPE, BTASIZENODE, BTASIZELARGELEAF, BTreeLeafLayout::GapBuffer> BTALargeGapType;
+typedef ConcurrentBTreeVector<BTATYPE, BTASIZENODE, BTASIZELEAF> BTAConcurrentType;
+typedef BTreeVector<BTATYPE, BTASIZENODE, BTASIZELEAF, BTreeLeafLayout::Plain, 16> BTAInlineType;
+typedef std::tuple<long long, int, double, int> BTARecord;
+typedef BTreeVector<BTARecord, BTASIZENODE, BTASIZELEAF> BTARecordType;
+typedef BTreeVector<BTARecord, BTASIZENODE, BTASIZELEAF, BTreeLeafLayout::Columnar> BTAColumnarType;
+typedef BTreeVector<BTARecord, BTASIZENODE, BTASIZELARGELEAF> BTALargeRecordType;
+typedef BTreeVector<BTARecord, BTASIZENODE, BTASIZELARGELEAF, BTreeLeafLayout::Columnar> BTALargeColumnarType;
 
 #define dspElapsed(dsp,tstart) \
 {\
@@ -44,6 +65,16 @@ inline int toValInt(int value)
     return value;
 }
 
+inline long long fromValStr(const std::string & value)
+{
+    return atoll(value.c_str());
+}
+
+inline long long fromValInt(int value)
+{
+    return value;
+}
+
 template<class ARR>
 void atestspeed(int lmax)
 {
@@ -59,10 +90,10 @@ void atestspeed(int lmax)
     for (int i = 0; i < lmax; i++)
     {
         eval = toVal(i * 2);
-        bta.add(eval);
+        bta.push_back(eval);
     }
 
-    dspElapsed("append               ", tstart1);
+    dspElapsed("append (push_back)   ", tstart1);
 
     //---------------
     bta.clear();
@@ -120,6 +151,32 @@ void atestspeed(int lmax)
     //--------------
     tstart1 = std::chrono::system_clock::now();
 
+    for (int i = 0; i < lmax; i++)
+        eval = bta[i];
+    eval = toVal(0);
+
+    dspElapsed("[] iteration   ", tstart1);
+
+    //--------------
+    tstart1 = std::chrono::system_clock::now();
+
+    for (int i = 0; i < lmax; i++)
+        eval = bta.at(i);
+    eval = toVal(0);
+
+    dspElapsed("at iteration   ", tstart1);
+
+    try
+    {
+        bta.at(lmax);
+        assert(false && "at() out of range");
+    } catch (std::out_of_range & e)
+    {
+    }
+
+    //--------------
+    tstart1 = std::chrono::system_clock::now();
+
     for (int i = 0; i < lmax; i++)
     {
         int pos = std::rand() % (bta.size() + 1);
@@ -152,7 +209,10 @@ void atestspeed(int lmax)
             if (t == 0)
                 pos = lmax - i - 1;
             if (t == 1)
-                pos = 0;
+            {
+                bta.pop_front();
+                continue;
+            }
             if (t == 2)
             {
                 //pos = bta.size() / 2;
@@ -164,20 +224,742 @@ void atestspeed(int lmax)
 
         }
         char buf[256];
-        sprintf(buf, "remove at %s", t == 0 ? "end       " : t == 1 ? "0         " : "random pos");
+        sprintf(buf, "remove at %s", t == 0 ? "end        " : t == 1 ? "0 pop_front" : "random pos ");
         dspElapsed(buf, tstart1);
     }
 
 }
 
+// typing-style sessions: a run of inserts at adjacent positions, then backspaces, at a random spot
+template<class ARR>
+void editSession(ARR & bta, int lmax, const char * dsp)
+{
+    std::srand(1);
+    for (int i = 0; i < lmax; i++)
+        bta.add(toVal(i));
+    auto tstart1 = std::chrono::system_clock::now();
+    for (int s = 0; s < lmax / 64; s++)
+    {
+        int cursor = std::rand() % (bta.size() + 1);
+        for (int i = 0; i < 64; i++)
+            bta.add(cursor++, toVal(i));
+        for (int i = 0; i < 32; i++)
+            bta.remove(--cursor);
+    }
+    dspElapsed(dsp, tstart1);
+}
+
+template<class PLAIN, class GAP>
+void atestedits(int lmax, int leafSize)
+{
+    printf("\nadjacent edits test for %'d elements, leaves of %d\n", lmax, leafSize);
+    PLAIN plain;
+    GAP gap;
+    editSession(plain, lmax, "plain layout         ");
+    editSession(gap, lmax, "gap layout           ");
+    assert(plain.size() == gap.size());
+    for (unsigned i = 0; i < plain.size(); i++)
+        assert(plain.get(i) == gap.get(i));
+}
+
+template<class ARR>
+void atestcompress(int lmax)
+{
+    printf("\ncompressed leaves test for %'d monotone ids\n", lmax);
+
+    ARR bta;
+    std::vector<BTATYPE> ref;
+    int id = 0;
+    for (int i = 0; i < lmax; i++)
+    {
+        id += 1 + std::rand() % 8;
+        bta.add(toVal(id));
+        ref.push_back(toVal(id));
+    }
+
+    for (int frozen = 0; frozen <= 1; frozen++)
+    {
+        if (frozen)
+            printf("frozen leaves: %'d\n", bta.freeze());
+        printf("memory %s %6.2lf bytes per element\n", frozen ? "frozen" : "plain ", (double) bta.memoryUsage() / bta.size());
+        auto tstart1 = std::chrono::system_clock::now();
+        long long sum = 0;
+        for (int r = 0; r < 10; r++)
+            for (int i = 0; i < lmax; i++)
+                sum += bta.get(i);
+        dspElapsed(frozen ? "get iteration frozen " : "get iteration plain  ", tstart1);
+        assert(sum > 0);
+
+        // bulk decode: frozen leaves are unpacked into a scratch buffer a leaf at a time
+        tstart1 = std::chrono::system_clock::now();
+        long long spanSum = 0;
+        for (int r = 0; r < 10; r++)
+            bta.forEachConstSpan([&spanSum](const BTATYPE * data, int n)
+            {
+                for (int i = 0; i < n; i++)
+                    spanSum += fromVal(data[i]);
+            });
+        dspElapsed(frozen ? "span scan frozen     " : "span scan plain      ", tstart1);
+        assert(spanSum == sum);
+    }
+    // ids are unique, searches decode frozen leaves in chunks and keep them packed
+    for (int i = 0; i < 1000; i++)
+    {
+        int j = std::rand() % lmax;
+        assert(bta.find(ref[j]) == j && bta.rfind(ref[j]) == j && bta.count(ref[j]) == 1);
+        assert(bta.find(toVal(fromVal(ref[j]) + 1), j + 1) == (j + 1 < lmax && fromVal(ref[j + 1]) == fromVal(ref[j]) + 1 ? j + 1 : -1));
+    }
+    printf("memory after scans %6.2lf bytes per element\n", (double) bta.memoryUsage() / bta.size());
+
+    // writes unpack only the leaves they touch
+    for (int i = 0; i < 1000; i++)
+    {
+        int pos = std::rand() % (ref.size() + 1);
+        bta.add(pos, toVal(i));
+        ref.insert(ref.begin() + pos, toVal(i));
+        pos = std::rand() % ref.size();
+        bta.remove(pos);
+        ref.erase(ref.begin() + pos);
+    }
+    printf("memory after writes %6.2lf bytes per element\n", (double) bta.memoryUsage() / bta.size());
+    for (unsigned j = 0; j < ref.size(); j++)
+        assert(ref[j] == bta.get(j));
+}
+
+template<class ARR>
+void atestcompact(int lmax)
+{
+    printf("\ncompact test for %'d elements\n", lmax);
+
+    ARR bta;
+    for (int i = 0; i < lmax; i++)
+        bta.add(toVal(i));
+    for (int i = 0; i < lmax / 2; i++)
+        bta.remove(std::rand() % bta.size());
+    printf("memory after deletes %6.2lf bytes per element\n", (double) bta.memoryUsage() / bta.size());
+
+    std::vector<BTATYPE> ref;
+    for (unsigned i = 0; i < bta.size(); i++)
+        ref.push_back(bta.get(i));
+
+    auto tstart1 = std::chrono::system_clock::now();
+    int steps = 1;
+    while (!bta.compact(1.0f, lmax / 20))
+        steps++;
+    dspElapsed("compact              ", tstart1);
+    printf("compact steps %d, memory %6.2lf bytes per element\n", steps, (double) bta.memoryUsage() / bta.size());
+
+    tstart1 = std::chrono::system_clock::now();
+    bta.shrink_to_fit();
+    dspElapsed("shrink_to_fit        ", tstart1);
+    printf("memory after shrink_to_fit %6.2lf bytes per element\n", (double) bta.memoryUsage() / bta.size());
+
+    tstart1 = std::chrono::system_clock::now();
+    for (unsigned i = 0; i < ref.size(); i++)
+        assert(ref[i] == bta.get(i));
+    dspElapsed("get iteration  ", tstart1);
+}
+
+template<class ARR>
+void atestfind(int lmax)
+{
+    printf("\nfind test for %'d elements\n", lmax);
+
+    ARR bta;
+    for (int i = 0; i < lmax; i++)
+        bta.add(toVal(i % 1000));
+    BTATYPE needle = toVal(-1);
+    bta.add(lmax - 10, needle);
+
+    auto tstart1 = std::chrono::system_clock::now();
+    int found = -1;
+    for (int r = 0; r < 10; r++)
+        for (int i = 0; i < (int) bta.size(); i++)
+            if (bta.get(i) == needle)
+            {
+                found = i;
+                break;
+            }
+    dspElapsed("find by get loop x10 ", tstart1);
+    assert(found == lmax - 10);
+
+    tstart1 = std::chrono::system_clock::now();
+    for (int r = 0; r < 10; r++)
+        found = bta.find(needle);
+    dspElapsed("find x10             ", tstart1);
+    assert(found == lmax - 10);
+
+    tstart1 = std::chrono::system_clock::now();
+    for (int r = 0; r < 10; r++)
+        found = bta.rfind(needle);
+    dspElapsed("rfind x10            ", tstart1);
+    assert(found == lmax - 10);
+
+    tstart1 = std::chrono::system_clock::now();
+    int cnt = 0;
+    for (int r = 0; r < 10; r++)
+        cnt = bta.count(toVal(7));
+    dspElapsed("count x10            ", tstart1);
+    assert(cnt == lmax / 1000);
+
+    tstart1 = std::chrono::system_clock::now();
+    for (int r = 0; r < 10; r++)
+        found = bta.find_if([&needle](const BTATYPE & v)
+        {
+            return v == needle;
+        });
+    dspElapsed("find_if x10          ", tstart1);
+    assert(found == lmax - 10);
+
+    assert(bta.find(toVal(5), 6) == 1005 && bta.rfind(toVal(5), 1004) == 5);
+
+    // floating point lanes compare like ==: NaN is never found, -0.0 matches +0.0
+    BTreeVector<double, BTASIZENODE, BTASIZELEAF> reals;
+    for (int i = 0; i < 1000; i++)
+        reals.add(i % 3 == 0 ? std::nan("") : i % 3 == 1 ? -0.0 : i + 0.5);
+    assert(reals.find(std::nan("")) == -1 && reals.count(std::nan("")) == 0);
+    assert(reals.find(0.0) == 1 && reals.rfind(0.0) == 997 && reals.count(+0.0) == 333);
+    assert(reals.find(998.5, 100) == 998 && reals.count(998.5) == 1);
+    BTreeVector<float, BTASIZENODE, BTASIZELEAF> floats;
+    for (int i = 0; i < 1000; i++)
+        floats.add(i % 2 ? 0.0f : std::nanf(""));
+    assert(floats.find(-0.0f) == 1 && floats.rfind(-0.0f) == 999 && floats.count(-0.0f) == 500 && floats.find(std::nanf("")) == -1);
+}
+
+template<class ARR>
+void atestsort(int lmax)
+{
+    printf("\nsort test for %'d elements\n", lmax);
+
+    ARR bta;
+    for (int i = 0; i < lmax; i++)
+        bta.add(toVal(std::rand()));
+
+    auto tstart1 = std::chrono::system_clock::now();
+    std::vector<BTATYPE> copy;
+    for (int i = 0; i < lmax; i++)
+        copy.push_back(bta.get(i));
+    std::sort(copy.begin(), copy.end());
+    ARR sorted;
+    for (int i = 0; i < lmax; i++)
+        sorted.add(copy[i]);
+    dspElapsed("sort copy-out        ", tstart1);
+
+    tstart1 = std::chrono::system_clock::now();
+    bta.sort();
+    dspElapsed("sort in place        ", tstart1);
+    for (int i = 0; i < lmax; i++)
+        assert(bta.get(i) == copy[i]);
+
+    // stable: elements with equal keys keep their order
+    const int keyDiv = 10000000;
+    ARR keyed;
+    for (int i = 0; i < lmax; i++)
+        keyed.add(toVal((std::rand() % 100) * keyDiv + i));
+    tstart1 = std::chrono::system_clock::now();
+    keyed.stable_sort([](const BTATYPE & a, const BTATYPE & b)
+    {
+        return fromVal(a) / keyDiv < fromVal(b) / keyDiv;
+    });
+    dspElapsed("stable_sort by key   ", tstart1);
+    for (int i = 1; i < lmax; i++)
+    {
+        long long a = fromVal(keyed.get(i - 1)), b = fromVal(keyed.get(i));
+        assert(a / keyDiv < b / keyDiv || (a / keyDiv == b / keyDiv && a < b));
+    }
+
+    // bool takes the comparison sort, its runs are not kept in a std::vector<bool>
+    BTreeVector<bool, BTASIZENODE, BTASIZELEAF> flags;
+    int setCount = 0;
+    for (int i = 0; i < lmax; i++)
+    {
+        flags.add(std::rand() % 3 == 0);
+        setCount += flags.get(i);
+    }
+    flags.sort();
+    assert(flags.find(true) == lmax - setCount && flags.rfind(false) == lmax - setCount - 1);
+}
+
+// many short vectors, a few elements each
+template<class ARR>
+void atestsmall(int count, int len, const char * dsp)
+{
+    auto tstart1 = std::chrono::system_clock::now();
+    std::vector<ARR> arrays(count);
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < len; j++)
+            arrays[i].add(toVal(j));
+    long long sum = 0;
+    size_t memory = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < len; j++)
+            sum += fromVal(arrays[i].get(j));
+        memory += arrays[i].memoryUsage();
+    }
+    arrays.clear();
+    dspElapsed(dsp, tstart1);
+    printf("memory per vector %'zu\n", memory / count);
+    assert(sum == (long long) count * len * (len - 1) / 2);
+}
+
+// queue use: append at the end, consume from the front
+template<class ARR>
+void atestdeque(int lmax)
+{
+    printf("\ndeque test for %'d elements\n", lmax);
+
+    std::deque<BTATYPE> deq;
+    auto tstart1 = std::chrono::system_clock::now();
+    for (int i = 0; i < lmax; i++)
+        deq.push_back(toVal(i));
+    dspElapsed("std::deque push_back ", tstart1);
+
+    ARR bta;
+    tstart1 = std::chrono::system_clock::now();
+    for (int i = 0; i < lmax; i++)
+        bta.push_back(toVal(i));
+    dspElapsed("push_back            ", tstart1);
+
+    tstart1 = std::chrono::system_clock::now();
+    long long sum1 = 0;
+    for (int i = 0; i < lmax; i++)
+    {
+        sum1 += fromVal(deq.front());
+        deq.pop_front();
+    }
+    dspElapsed("std::deque pop_front ", tstart1);
+
+    tstart1 = std::chrono::system_clock::now();
+    long long sum2 = 0;
+    for (int i = 0; i < lmax; i++)
+    {
+        sum2 += fromVal(bta.front());
+        bta.pop_front();
+    }
+    dspElapsed("pop_front            ", tstart1);
+    assert(sum1 == sum2 && bta.size() == 0);
+
+    tstart1 = std::chrono::system_clock::now();
+    for (int i = 0; i < lmax; i++)
+    {
+        bta.push_back(toVal(i));
+        if (i & 1)
+            bta.pop_front();
+    }
+    dspElapsed("queue                ", tstart1);
+    assert(bta.size() == (unsigned) (lmax - lmax / 2) && fromVal(bta.front()) == lmax / 2 && fromVal(bta.back()) == lmax - 1);
+
+    // deque operations leave counts above the edge leaves pending; positional operations in between must see them
+    bta.clear();
+    deq.clear();
+    for (int i = 0; i < lmax / 10; i++)
+    {
+        int op = std::rand() % 8;
+        if (op == 0)
+        {
+            bta.push_front(toVal(i));
+            deq.push_front(toVal(i));
+        } else if (op == 1 && deq.size() > 0)
+        {
+            bta.pop_back();
+            deq.pop_back();
+        } else if (op == 2 && deq.size() > 0)
+        {
+            bta.pop_front();
+            deq.pop_front();
+        } else if (op == 3)
+        {
+            int pos = std::rand() % (deq.size() + 1);
+            bta.add(pos, toVal(i));
+            deq.insert(deq.begin() + pos, toVal(i));
+        } else if (op == 4 && deq.size() > 0)
+        {
+            int pos = std::rand() % deq.size();
+            assert(bta.get(pos) == deq[pos] && bta.find(deq[pos]) == pos);
+        } else
+        {
+            bta.push_back(toVal(i));
+            deq.push_back(toVal(i));
+        }
+        assert(bta.size() == deq.size());
+    }
+    for (unsigned i = 0; i < deq.size(); i++)
+        assert(bta.get(i) == deq[i]);
+}
+
+// anchored elements followed through random inserts and removes
+template<class ARR>
+void atesthandles(int lmax)
+{
+    const int anchorCount = 1000;
+    printf("\nhandle test for %'d elements, %d handles\n", lmax, anchorCount);
+
+    ARR bta;
+    for (int i = 0; i < lmax; i++)
+        bta.add(toVal(i));
+    std::vector<typename ARR::Handle> handles;
+    std::vector<BTATYPE> anchored;
+    for (int i = 0; i < anchorCount; i++)
+    {
+        int pos = std::rand() % lmax;
+        handles.push_back(bta.handle(pos));
+        anchored.push_back(bta.get(pos));
+    }
+    // values stay unique, so find() locates an anchored element or returns -1 like position_of()
+    for (int i = 0; i < lmax / 10; i++)
+    {
+        bta.add(std::rand() % bta.size(), toVal(lmax + i));
+        bta.remove(std::rand() % bta.size());
+    }
+
+    auto tstart1 = std::chrono::system_clock::now();
+    std::vector<int> scanned(anchorCount);
+    for (int i = 0; i < anchorCount; i++)
+        scanned[i] = bta.find(anchored[i]);
+    dspElapsed("positions by find    ", tstart1);
+
+    tstart1 = std::chrono::system_clock::now();
+    for (int i = 0; i < anchorCount; i++)
+        assert(bta.position_of(handles[i]) == scanned[i]);
+    dspElapsed("position_of          ", tstart1);
+
+    for (auto h : handles)
+        bta.release(h);
+
+    // released handles are not held: a second release must not free an id twice
+    assert(bta.position_of(handles[0]) == -1);
+    bta.release(handles[0]);
+    int h1 = bta.handle(0), h2 = bta.handle(1);
+    assert(h1 != h2 && bta.position_of(h1) == 0 && bta.position_of(h2) == 1);
+    bta.release(h1);
+    bta.release(h2);
+
+    ARR empty;
+    assert(empty.position_of(0) == -1);
+    empty.release(0);
+}
+
+// delete heavy workloads under each rebalancing policy
+template<class ARR>
+void atestrebalance(int lmax)
+{
+    printf("\nrebalance test for %'d elements\n", lmax);
+
+    const BTreeRebalance policies[] = { BTreeRebalance::Eager, BTreeRebalance::Relaxed, BTreeRebalance::Deferred };
+    const char * names[] = { "eager  ", "relaxed", "deferred" };
+    for (int k = 0; k < 3; k++)
+    {
+        printf("policy %s\n", names[k]);
+        std::srand(1);
+        ARR bta;
+        bta.setRebalance(policies[k]);
+        for (int i = 0; i < lmax; i++)
+            bta.add(std::rand() % (bta.size() + 1), toVal(i));
+
+        std::vector<double> latency;
+        latency.reserve(lmax);
+        auto tstart1 = std::chrono::system_clock::now();
+        for (int i = 0; i < lmax; i++)
+        {
+            int pos = std::rand() % bta.size();
+            auto tstart2 = std::chrono::steady_clock::now();
+            if (i & 1)
+                bta.remove(pos);
+            else
+                bta.add(pos, toVal(i));
+            latency.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - tstart2).count());
+        }
+        dspElapsed("mixed add/remove     ", tstart1);
+        // single samples are scheduler noise, tail percentiles are not
+        std::sort(latency.begin(), latency.end());
+        printf("latency p50 %.0lf ns, p99 %.0lf ns, p99.9 %.0lf ns\n", latency[latency.size() / 2],
+                latency[latency.size() * 99 / 100], latency[latency.size() * 999 / 1000]);
+
+        tstart1 = std::chrono::system_clock::now();
+        for (int i = 0; i < lmax / 2; i++)
+            bta.remove(std::rand() % bta.size());
+        dspElapsed("remove at random pos ", tstart1);
+        printf("memory %6.2lf bytes per element\n", (double) bta.memoryUsage() / bta.size());
+
+        std::vector<BTATYPE> ref;
+        for (unsigned i = 0; i < bta.size(); i++)
+            ref.push_back(bta.get(i));
+        tstart1 = std::chrono::system_clock::now();
+        bta.compact();
+        dspElapsed("compact              ", tstart1);
+        printf("memory after compact %6.2lf bytes per element\n", (double) bta.memoryUsage() / bta.size());
+        for (unsigned i = 0; i < ref.size(); i++)
+            assert(ref[i] == bta.get(i));
+
+        // compact() left every leaf full: an add splits the leaf in two halves and a remove
+        // from the other half drops that one below half, which eager rebalancing merges back
+        int leafStart = (int) (bta.size() / 2) / BTASIZELEAF * BTASIZELEAF;
+        tstart1 = std::chrono::system_clock::now();
+        for (int i = 0; i < lmax; i++)
+        {
+            bta.add(leafStart + BTASIZELEAF / 8, toVal(i));
+            bta.remove(leafStart + BTASIZELEAF * 7 / 8);
+        }
+        dspElapsed("split/merge at a leaf", tstart1);
+        assert(bta.size() == ref.size());
+    }
+}
+
+// single field scans over row and columnar leaves
+template<class ROWS, class COLUMNS>
+void atestcolumnar(int lmax, int leafSize)
+{
+    printf("\ncolumnar test for %'d records, leaf size %d\n", lmax, leafSize);
+
+    ROWS rows;
+    COLUMNS columns;
+    for (int i = 0; i < lmax; i++)
+    {
+        int pos = i - std::rand() % (i + 1) / 8;
+        BTARecord r(i, i % 1000, i * 0.5, -i);
+        rows.add(pos, r);
+        columns.add(pos, r);
+    }
+
+    auto tstart1 = std::chrono::system_clock::now();
+    double rowSum = 0;
+    for (int r = 0; r < 10; r++)
+        rows.forEachSpan([&rowSum](const BTARecord * data, int n)
+        {
+            for (int i = 0; i < n; i++)
+                rowSum += std::get<2>(data[i]);
+        });
+    dspElapsed("field sum rows x10   ", tstart1);
+
+    tstart1 = std::chrono::system_clock::now();
+    double columnSum = 0;
+    for (int r = 0; r < 10; r++)
+        columns.template forEachColumn<2>([&columnSum](const double * data, int n)
+        {
+            for (int i = 0; i < n; i++)
+                columnSum += data[i];
+        });
+    dspElapsed("field sum columns x10", tstart1);
+    assert(rowSum == columnSum);
+
+    // an integral field: no floating point add chain, so the scans are bound by the bytes they pull in
+    tstart1 = std::chrono::system_clock::now();
+    long long rowIdSum = 0;
+    for (int r = 0; r < 10; r++)
+        rows.forEachSpan([&rowIdSum](const BTARecord * data, int n)
+        {
+            for (int i = 0; i < n; i++)
+                rowIdSum += std::get<1>(data[i]);
+        });
+    std::chrono::duration<double> rowTime = std::chrono::system_clock::now() - tstart1;
+    dspElapsed("int field rows x10   ", tstart1);
+
+    tstart1 = std::chrono::system_clock::now();
+    long long columnIdSum = 0;
+    for (int r = 0; r < 10; r++)
+        columns.template forEachColumn<1>([&columnIdSum](const int * data, int n)
+        {
+            for (int i = 0; i < n; i++)
+                columnIdSum += data[i];
+        });
+    std::chrono::duration<double> columnTime = std::chrono::system_clock::now() - tstart1;
+    dspElapsed("int field columns x10", tstart1);
+    assert(rowIdSum == columnIdSum);
+    printf("int field rows/columns time %.1lf, record/field width %d\n", rowTime.count() / columnTime.count(), (int) (sizeof(BTARecord) / sizeof(int)));
+
+    printf("memory rows %'zu columns %'zu\n", rows.memoryUsage(), columns.memoryUsage());
+    for (int i = 0; i < lmax; i++)
+        assert(rows.get(i) == columns.get(i) && columns.template getField<3>(i) == std::get<3>(rows.get(i)));
+    assert(columns.find(rows.get(lmax / 2)) == lmax / 2);
+
+    // the read-only walk decodes frozen columns without thawing them
+    columns.freeze();
+    size_t frozenMemory = columns.memoryUsage();
+    long long frozenIdSum = 0;
+    columns.template forEachConstColumn<1>([&frozenIdSum](const int * data, int n)
+    {
+        for (int i = 0; i < n; i++)
+            frozenIdSum += data[i];
+    });
+    assert(frozenIdSum == rowIdSum / 10 && columns.memoryUsage() == frozenMemory);
+    printf("memory frozen columns %'zu\n", frozenMemory);
+}
+
+// Columnar elements other than std::tuple
+void atestcolumnartypes()
+{
+    BTreeVector<std::pair<int, double>, BTASIZENODE, BTASIZELEAF, BTreeLeafLayout::Columnar> pairs;
+    BTreeVector<std::array<int, 3>, BTASIZENODE, BTASIZELEAF, BTreeLeafLayout::Columnar> arrays;
+    std::vector<std::pair<int, double>> pairsRef;
+    std::vector<std::array<int, 3>> arraysRef;
+    for (int i = 0; i < 1000; i++)
+    {
+        pairs.add(i / 2, std::make_pair(i, i * 0.5));
+        pairsRef.insert(pairsRef.begin() + i / 2, std::make_pair(i, i * 0.5));
+        arrays.add(i / 2, std::array<int, 3> { i, -i, i % 7 });
+        arraysRef.insert(arraysRef.begin() + i / 2, std::array<int, 3> { i, -i, i % 7 });
+    }
+    for (int i = 0; i < 1000; i++)
+        assert(pairs.get(i) == pairsRef[i] && pairs.template getField<1>(i) == pairsRef[i].second && arrays.get(i) == arraysRef[i]);
+    assert(arrays.find(arraysRef[700]) == 700);
+    long long total = 0;
+    arrays.template forEachConstColumn<1>([&total](const int * data, int n)
+    {
+        for (int i = 0; i < n; i++)
+            total += data[i];
+    });
+    assert(total == -999 * 1000 / 2);
+}
+
+// each thread inserts into its own region; a non-null lock serializes the inserts
+// returns the elapsed time in seconds
+template<class ARR>
+double concurrentInserts(ARR & bta, std::mutex * lock, unsigned threads, int lmax)
+{
+    for (int i = 0; i < lmax; i++)
+        bta.add(toVal(i));
+
+    auto tstart1 = std::chrono::system_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+        workers.emplace_back([&bta, lock, t, threads, lmax]()
+        {
+            std::minstd_rand rnd(t + 1);
+            int region = lmax / threads;
+            for (int i = 0; i < region; i++)
+            {
+                int pos = t * region + rnd() % region;
+                if (lock != nullptr)
+                {
+                    std::lock_guard<std::mutex> guard(*lock);
+                    bta.add(pos, toVal(i));
+                }
+                else
+                    bta.add(pos, toVal(i));
+            }
+        });
+    for (auto & w : workers)
+        w.join();
+    char buf[256];
+    sprintf(buf, "%2u threads %s", threads, lock != nullptr ? "global mutex" : "concurrent  ");
+    dspElapsed(buf, tstart1);
+    assert(bta.size() == (unsigned ) (lmax + lmax / threads * threads));
+    std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - tstart1;
+    return elapsed.count();
+}
+
+template<class ARR, class CARR>
+void atestconcurrent(int lmax)
+{
+    unsigned hwThreads = std::thread::hardware_concurrency();
+    printf("\nconcurrent insert test for %'d elements, %u hardware threads\n", lmax, hwThreads);
+
+    // every run inserts lmax elements in total, the ratio is against the one-thread run of the same variant;
+    // it shows scaling only while the threads have cores of their own
+    double single[2] = { 0, 0 };
+    for (unsigned threads = 1; threads <= std::max(4u, hwThreads); threads *= 2)
+    {
+        std::mutex lock;
+        ARR bta;
+        double locked = concurrentInserts(bta, &lock, threads, lmax);
+        CARR cbta;
+        double concurrent = concurrentInserts(cbta, nullptr, threads, lmax);
+        if (threads == 1)
+        {
+            single[0] = locked;
+            single[1] = concurrent;
+        }
+        printf("throughput %2u threads / 1 thread: global mutex %5.2lf, concurrent %5.2lf%s\n", threads, single[0] / locked,
+                single[1] / concurrent, threads > hwThreads ? " (more threads than cores, not a scaling result)" : "");
+    }
+}
+
+// Threads add, remove, set and get in their own regions. Every value is unique and tagged with its
+// thread, so the final contents must equal the initial ones plus everything added or set in,
+// minus everything removed or set over.
+template<class CARR>
+void atestconcurrentmixed(int lmax, unsigned threads)
+{
+    printf("\nconcurrent add/remove/set/get test, %u threads, %'d operations\n", threads, lmax);
+
+    CARR bta;
+    std::vector<BTATYPE> initial;
+    for (int i = 0; i < lmax / 4; i++)
+    {
+        bta.add(toVal(i));
+        initial.push_back(toVal(i));
+    }
+    int opsPerThread = lmax / threads;
+    int tags = lmax / 4 + (threads + 1) * opsPerThread;
+    std::vector<std::vector<BTATYPE>> added(threads), removed(threads);
+
+    auto tstart1 = std::chrono::system_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+        workers.emplace_back([&bta, &added, &removed, t, threads, opsPerThread, tags, lmax]()
+        {
+            std::minstd_rand rnd(t + 1);
+            int tag = lmax / 4 + (t + 1) * opsPerThread;
+            for (int i = 0; i < opsPerThread; i++)
+            {
+                // regions end a tenth short of the size, which the other threads cannot remove meanwhile
+                int size = bta.size();
+                int region = size * 9 / 10 / threads;
+                int pos = t * region + rnd() % region;
+                int op = rnd() % 100;
+                if (op < 35)
+                {
+                    bta.add(pos, toVal(tag));
+                    added[t].push_back(toVal(tag++));
+                } else if (op < 65)
+                    removed[t].push_back(bta.remove(pos));
+                else if (op < 80)
+                {
+                    removed[t].push_back(bta.set(pos, toVal(tag)));
+                    added[t].push_back(toVal(tag++));
+                } else
+                {
+                    int v = fromVal(bta.get(pos));
+                    assert(v >= 0 && v < tags);
+                    (void) v;
+                }
+            }
+        });
+    for (auto & w : workers)
+        w.join();
+    dspElapsed("mixed operations     ", tstart1);
+
+    std::vector<BTATYPE> expected = initial, gone, contents;
+    for (unsigned t = 0; t < threads; t++)
+    {
+        expected.insert(expected.end(), added[t].begin(), added[t].end());
+        gone.insert(gone.end(), removed[t].begin(), removed[t].end());
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(gone.begin(), gone.end());
+    std::vector<BTATYPE> left;
+    std::set_difference(expected.begin(), expected.end(), gone.begin(), gone.end(), std::back_inserter(left));
+    assert(left.size() + gone.size() == expected.size() && "every removed value was added once");
+    assert(bta.size() == left.size());
+    for (unsigned i = 0; i < bta.size(); i++)
+        contents.push_back(bta.get(i));
+    std::sort(contents.begin(), contents.end());
+    assert(contents == left);
+    printf("contents ok, %'u elements\n", bta.size());
+}
+
 template<class ARR2>
-void atestvalid(int lmax)
+void atestvalid(int lmax, BTreeRebalance policy = BTreeRebalance::Eager)
 {
 
-    printf("\nvalidation test comparing to std::vector.  insert,remove,get at random positions\n");
+    const char * policyNames[] = { "eager", "relaxed", "deferred" };
+    printf("\nvalidation test comparing to std::vector.  insert,remove,get at random positions, %s rebalance\n",
+            policyNames[(int) policy]);
 
     std::vector<BTATYPE> a1;
     ARR2 a2;
+    a2.setRebalance(policy);
 
     auto tstart = std::chrono::system_clock::now();
 
@@ -263,7 +1045,31 @@ int main(int argc, char *argv[])
     printf("\ndata type: %s\n", printtype);
     int lmax = 1000000;
     atestspeed<BTAType>(lmax);
+#ifndef BTA_STRING_TEST
+    atestcompress<BTAType>(lmax);
+#endif
+    atestcompact<BTAType>(lmax);
+    atestfind<BTAType>(lmax);
+    atestsort<BTAType>(lmax);
+    atestcolumnar<BTARecordType, BTAColumnarType>(lmax, BTASIZELEAF);
+    atestcolumnar<BTALargeRecordType, BTALargeColumnarType>(lmax, BTASIZELARGELEAF);
+    atestcolumnartypes();
+    atestdeque<BTAType>(lmax);
+    atesthandles<BTAType>(lmax);
+    atestrebalance<BTAType>(lmax);
+    printf("\nsmall vector test, %'d vectors of 10 elements\n", lmax / 10);
+    atestsmall<BTAType>(lmax / 10, 10, "tree                 ");
+    atestsmall<BTAInlineType>(lmax / 10, 10, "inline 16            ");
+    atestconcurrent<BTAType, BTAConcurrentType>(lmax);
+    atestconcurrentmixed<BTAConcurrentType>(lmax, std::max(4u, std::thread::hardware_concurrency()));
     atestvalid<BTAType>(100000);
+    atestvalid<BTAType>(100000, BTreeRebalance::Relaxed);
+    atestvalid<BTAType>(100000, BTreeRebalance::Deferred);
+    printf("\nleaf layout: GAP BUFFER\n");
+    atestspeed<BTAGapType>(lmax);
+    atestvalid<BTAGapType>(100000);
+    atestedits<BTAType, BTAGapType>(lmax, BTASIZELEAF);
+    atestedits<BTALargeType, BTALargeGapType>(lmax, BTASIZELARGELEAF);
     return 0;
 }
 